@@ -109,6 +109,7 @@ def list_wayland_protocols():
     wayland_protocols.append((system_protocol_dir / "stable/xdg-shell/xdg-shell.xml", "xdg-shell"))
     wayland_protocols.append((system_protocol_dir / "unstable/xdg-decoration/xdg-decoration-unstable-v1.xml", "xdg-decoration-unstable-v1"))
     wayland_protocols.append((system_protocol_dir / "stable/linux-dmabuf/linux-dmabuf-v1.xml", "linux-dmabuf-v1"))
+    wayland_protocols.append((system_protocol_dir / "stable/presentation-time/presentation-time.xml", "presentation-time"))
 
     return wayland_protocols
 
@@ -9,6 +9,9 @@ static struct {
     wrei_log_level log_level = wrei_log_level::trace;
     std::ofstream log_file;
     MessageConnection* ipc_sink = {};
+
+    // Messages may be logged from the render thread
+    std::mutex mutex;
 } wrei_log_state = {};
 
 void wrei_log_set_message_sink(struct MessageConnection* conn)
@@ -44,6 +47,7 @@ void wrei_log(wrei_log_level level, std::string_view message)
         case wrei_log_level::fatal: fmt = { "[" WREI_VT_COLOR(91, "FATAL") "] {}\n",                     "[FATAL] {}\n" }; break;
     }
 
+    std::scoped_lock lock{wrei_log_state.mutex};
     std::cout << std::vformat(fmt.vt, std::make_format_args(message));
     if (wrei_log_state.log_file.is_open()) {
         wrei_log_state.log_file << std::vformat(fmt.plain, std::make_format_args(message)) << std::flush;
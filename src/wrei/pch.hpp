@@ -21,6 +21,12 @@
 #include <ranges>
 #include <random>
 #include <stacktrace>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 
 #include <cstring>
 #include <csignal>
@@ -31,11 +37,17 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <poll.h>
 
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+
+#include <linux/dma-buf.h>
 
 #include <drm/drm_fourcc.h>
 
@@ -97,6 +109,7 @@
 #include <wayland-client-core.h>
 #include <xdg-shell-client-protocol.h>
 #include <xdg-decoration-unstable-v1-client-protocol.h>
+#include <presentation-time-client-protocol.h>
 
 // -----------------------------------------------------------------------------
 
@@ -0,0 +1,256 @@
+#include "pixel.hpp"
+#include "log.hpp"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+wrei_simd_level wrei_get_simd_level()
+{
+#if defined(__x86_64__)
+    static wrei_simd_level level = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))   return wrei_simd_level::avx2;
+        if (__builtin_cpu_supports("sse4.1")) return wrei_simd_level::sse4;
+        return wrei_simd_level::scalar;
+    }();
+    return level;
+#else
+    return wrei_simd_level::scalar;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+//
+// RGB888 is stored as B, G, R and BGR888 as R, G, B, so the 24-bit kernels only need to insert
+// alpha, and optionally swap the outer channels. 16-bit kernels expand each channel by replicating
+// its high bits into the low bits, which maps the maximum channel value to 0xFF exactly
+//
+
+template<bool Swap>
+static
+void wrei_convert_24_scalar(void* dst, const void* src, usz count)
+{
+    auto* s = static_cast<const u8*>(src);
+    auto* d = static_cast<u8*>(dst);
+    for (usz i = 0; i < count; ++i) {
+        d[i * 4 + 0] = s[i * 3 + (Swap ? 2 : 0)];
+        d[i * 4 + 1] = s[i * 3 + 1];
+        d[i * 4 + 2] = s[i * 3 + (Swap ? 0 : 2)];
+        d[i * 4 + 3] = 0xFF;
+    }
+}
+
+template<bool Swap>
+static
+void wrei_convert_565_scalar(void* dst, const void* src, usz count)
+{
+    auto* s = static_cast<const u8*>(src);
+    auto* d = static_cast<u8*>(dst);
+    for (usz i = 0; i < count; ++i) {
+        u16 p;
+        std::memcpy(&p, s + i * 2, sizeof(p));
+
+        u32 hi = p >> 11;
+        u32 g = (p >> 5) & 0x3F;
+        u32 lo = p & 0x1F;
+
+        u32 r = Swap ? lo : hi;
+        u32 b = Swap ? hi : lo;
+
+        r = (r << 3) | (r >> 2);
+        g = (g << 2) | (g >> 4);
+        b = (b << 3) | (b >> 2);
+
+        u32 out = 0xFF000000 | r << 16 | g << 8 | b;
+        std::memcpy(d + i * 4, &out, sizeof(out));
+    }
+}
+
+#if defined(__x86_64__)
+
+template<bool Swap>
+static
+__m128i wrei_convert_24_mask()
+{
+    return Swap
+        ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7,  6, -1, 11, 10,  9, -1)
+        : _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7,  8, -1,  9, 10, 11, -1);
+}
+
+template<bool Swap>
+[[gnu::target("sse4.1")]] static
+void wrei_convert_24_sse4(void* dst, const void* src, usz count)
+{
+    auto* s = static_cast<const u8*>(src);
+    auto* d = static_cast<u8*>(dst);
+
+    const __m128i mask = wrei_convert_24_mask<Swap>();
+    const __m128i alpha = _mm_set1_epi32(i32(0xFF000000));
+
+    // Each load reads 16 bytes to convert 4 pixels, so stop while the load is still in bounds
+
+    usz i = 0;
+    for (; i + 6 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i * 3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i * 4), _mm_or_si128(_mm_shuffle_epi8(v, mask), alpha));
+    }
+
+    wrei_convert_24_scalar<Swap>(d + i * 4, s + i * 3, count - i);
+}
+
+template<bool Swap>
+[[gnu::target("avx2")]] static
+void wrei_convert_24_avx2(void* dst, const void* src, usz count)
+{
+    auto* s = static_cast<const u8*>(src);
+    auto* d = static_cast<u8*>(dst);
+
+    // Shuffles can't cross 128-bit lanes, so first move the second group of 4 pixels into the upper lane
+
+    const __m256i permute = _mm256_setr_epi32(0, 1, 2, 2, 3, 4, 5, 5);
+    const __m256i mask = _mm256_broadcastsi128_si256(wrei_convert_24_mask<Swap>());
+    const __m256i alpha = _mm256_set1_epi32(i32(0xFF000000));
+
+    usz i = 0;
+    for (; i + 11 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i * 3));
+        v = _mm256_permutevar8x32_epi32(v, permute);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i * 4), _mm256_or_si256(_mm256_shuffle_epi8(v, mask), alpha));
+    }
+
+    wrei_convert_24_sse4<Swap>(d + i * 4, s + i * 3, count - i);
+}
+
+template<bool Swap>
+[[gnu::target("sse4.1")]] static
+void wrei_convert_565_sse4(void* dst, const void* src, usz count)
+{
+    auto* s = static_cast<const u8*>(src);
+    auto* d = static_cast<u8*>(dst);
+
+    const __m128i mask5 = _mm_set1_epi16(0x1F);
+    const __m128i mask6 = _mm_set1_epi16(0x3F);
+    const __m128i alpha = _mm_set1_epi16(i16(0xFF00));
+
+    usz i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i * 2));
+
+        __m128i hi = _mm_srli_epi16(p, 11);
+        __m128i g  = _mm_and_si128(_mm_srli_epi16(p, 5), mask6);
+        __m128i lo = _mm_and_si128(p, mask5);
+
+        __m128i r = Swap ? lo : hi;
+        __m128i b = Swap ? hi : lo;
+
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+
+        // Interleave (B | G << 8) and (R | A << 8) halves into whole pixels
+
+        __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+        __m128i ra = _mm_or_si128(r, alpha);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i * 4),      _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i * 4 + 16), _mm_unpackhi_epi16(bg, ra));
+    }
+
+    wrei_convert_565_scalar<Swap>(d + i * 4, s + i * 2, count - i);
+}
+
+template<bool Swap>
+[[gnu::target("avx2")]] static
+void wrei_convert_565_avx2(void* dst, const void* src, usz count)
+{
+    auto* s = static_cast<const u8*>(src);
+    auto* d = static_cast<u8*>(dst);
+
+    const __m256i mask5 = _mm256_set1_epi16(0x1F);
+    const __m256i mask6 = _mm256_set1_epi16(0x3F);
+    const __m256i alpha = _mm256_set1_epi16(i16(0xFF00));
+
+    usz i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i * 2));
+
+        __m256i hi = _mm256_srli_epi16(p, 11);
+        __m256i g  = _mm256_and_si256(_mm256_srli_epi16(p, 5), mask6);
+        __m256i lo = _mm256_and_si256(p, mask5);
+
+        __m256i r = Swap ? lo : hi;
+        __m256i b = Swap ? hi : lo;
+
+        r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+        g = _mm256_or_si256(_mm256_slli_epi16(g, 2), _mm256_srli_epi16(g, 4));
+        b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+
+        __m256i bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+        __m256i ra = _mm256_or_si256(r, alpha);
+
+        // Unpacking works per lane, giving pixels 0-3 and 8-11 in the low half, and 4-7 and 12-15 in the high half
+
+        __m256i low  = _mm256_unpacklo_epi16(bg, ra);
+        __m256i high = _mm256_unpackhi_epi16(bg, ra);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i * 4),      _mm256_permute2x128_si256(low, high, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i * 4 + 32), _mm256_permute2x128_si256(low, high, 0x31));
+    }
+
+    wrei_convert_565_sse4<Swap>(d + i * 4, s + i * 2, count - i);
+}
+
+#define WREI_PIXEL_KERNELS(Name, Swap) { Name##_scalar<Swap>, Name##_sse4<Swap>, Name##_avx2<Swap> }
+#else
+#define WREI_PIXEL_KERNELS(Name, Swap) { Name##_scalar<Swap>, nullptr, nullptr }
+#endif
+
+// -----------------------------------------------------------------------------
+
+struct wrei_pixel_kernels
+{
+    u32 drm_format;
+    u32 src_size;
+
+    // Indexed by wrei_simd_level
+    std::array<wrei_pixel_convert_fn, 3> kernels;
+};
+
+static const wrei_pixel_kernels wrei_pixel_kernel_table[] {
+    { DRM_FORMAT_RGB888, 3, WREI_PIXEL_KERNELS(wrei_convert_24,  false) },
+    { DRM_FORMAT_BGR888, 3, WREI_PIXEL_KERNELS(wrei_convert_24,  true)  },
+    { DRM_FORMAT_RGB565, 2, WREI_PIXEL_KERNELS(wrei_convert_565, false) },
+    { DRM_FORMAT_BGR565, 2, WREI_PIXEL_KERNELS(wrei_convert_565, true)  },
+};
+
+const wrei_pixel_converter* wrei_find_pixel_converter(u32 drm_format)
+{
+    static std::vector<wrei_pixel_converter> converters = [] {
+        auto level = wrei_get_simd_level();
+        log_info("Pixel conversion using {} kernels", magic_enum::enum_name(level));
+
+        std::vector<wrei_pixel_converter> out;
+        for (auto& entry : wrei_pixel_kernel_table) {
+            out.emplace_back(entry.drm_format, entry.src_size, entry.kernels[std::to_underlying(level)]);
+        }
+        return out;
+    }();
+
+    for (auto& converter : converters) {
+        if (converter.drm_format == drm_format) return &converter;
+    }
+
+    return nullptr;
+}
+
+wrei_pixel_convert_fn wrei_get_pixel_convert_fn(u32 drm_format, wrei_simd_level level)
+{
+    if (level > wrei_get_simd_level()) return nullptr;
+
+    for (auto& entry : wrei_pixel_kernel_table) {
+        if (entry.drm_format == drm_format) return entry.kernels[std::to_underlying(level)];
+    }
+
+    return nullptr;
+}
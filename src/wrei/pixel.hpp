@@ -0,0 +1,37 @@
+#pragma once
+
+#include "types.hpp"
+
+// -----------------------------------------------------------------------------
+
+enum class wrei_simd_level : u32
+{
+    scalar,
+    sse4,
+    avx2,
+};
+
+// Highest instruction set level supported by the CPU, detected on first use
+wrei_simd_level wrei_get_simd_level();
+
+// -----------------------------------------------------------------------------
+
+// Converts a row of pixels to DRM_FORMAT_ARGB8888 (B, G, R, A in memory) with opaque alpha
+using wrei_pixel_convert_fn = void(*)(void* dst, const void* src, usz count);
+
+struct wrei_pixel_converter
+{
+    u32 drm_format;
+
+    // Bytes per pixel in the source format
+    u32 src_size;
+
+    // Fastest variant supported by the CPU
+    wrei_pixel_convert_fn convert;
+};
+
+// Returns null if there is no converter for the format
+const wrei_pixel_converter* wrei_find_pixel_converter(u32 drm_format);
+
+// Returns a specific variant, for comparing against the others. Null if the CPU doesn't support the level
+wrei_pixel_convert_fn wrei_get_pixel_convert_fn(u32 drm_format, wrei_simd_level level);
@@ -11,7 +11,7 @@ struct wrei_weak_state
 
 #define WREI_NOISY_OBJECTS 1
 #if WREI_NOISY_OBJECTS
-static i64 wrei_debug_global_alive_objects;
+static std::atomic<i64> wrei_debug_global_alive_objects;
 #endif
 
 struct wrei_object
@@ -1,5 +1,17 @@
 #include "util.hpp"
 
+static
+pixman_box32_t wrei_rect_to_box(wrei_rect<i32> rect)
+{
+    // Clamp far edges to avoid overflow with "infinite" extents (e.g. INT32_MAX sized damage)
+    return pixman_box32_t {
+        .x1 = rect.origin.x,
+        .y1 = rect.origin.y,
+        .x2 = i32(std::min<i64>(i64(rect.origin.x) + std::max(rect.extent.x, 0), INT32_MAX)),
+        .y2 = i32(std::min<i64>(i64(rect.origin.y) + std::max(rect.extent.y, 0), INT32_MAX)),
+    };
+}
+
 wrei_region::wrei_region()
 {
     pixman_region32_init(&region);
@@ -7,19 +19,20 @@ wrei_region::wrei_region()
 
 wrei_region::wrei_region(wrei_rect<i32> rect)
 {
-    pixman_region32_init_rect(&region, rect.origin.x, rect.origin.y, rect.extent.x, rect.extent.y);
+    auto box = wrei_rect_to_box(rect);
+    pixman_region32_init_rect(&region, box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
 }
 
 
 wrei_region::wrei_region(const wrei_region& other)
 {
+    pixman_region32_init(&region);
     pixman_region32_copy(&region, &other.region);
 }
 
 wrei_region& wrei_region::operator=(const wrei_region& other)
 {
     if (this != &other) {
-        pixman_region32_fini(&region);
         pixman_region32_copy(&region, &other.region);
     }
     return *this;
@@ -50,21 +63,56 @@ wrei_region::~wrei_region()
 
 void wrei_region::add(wrei_rect<i32> rect)
 {
-    pixman_region32_union_rect(&region, &region, rect.origin.x, rect.origin.y, rect.extent.x, rect.extent.y);
+    auto box = wrei_rect_to_box(rect);
+    pixman_region32_union_rect(&region, &region, box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
+}
+
+void wrei_region::add(const wrei_region& other)
+{
+    pixman_region32_union(&region, &region, &other.region);
 }
 
 void wrei_region::subtract(wrei_rect<i32> rect)
 {
-    auto x = rect.origin.x;
-    auto y = rect.origin.y;
-    auto width = rect.extent.x;
-    auto height = rect.extent.y;
-    pixman_region32_union_rect(&region, &region, x, y, width, height);
+    subtract(wrei_region(rect));
+}
+
+void wrei_region::subtract(const wrei_region& other)
+{
+    pixman_region32_subtract(&region, &region, &other.region);
+}
+
+void wrei_region::intersect(wrei_rect<i32> rect)
+{
+    auto box = wrei_rect_to_box(rect);
+    pixman_region32_intersect_rect(&region, &region, box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
+}
+
+void wrei_region::intersect(const wrei_region& other)
+{
+    pixman_region32_intersect(&region, &region, &other.region);
+}
+
+void wrei_region::translate(wrei_vec2i32 offset)
+{
+    pixman_region32_translate(&region, offset.x, offset.y);
+}
 
-    pixman_region32_t subtrahend;
-    pixman_region32_init_rect(&subtrahend, x, y, width, height);
-    pixman_region32_subtract(&region, &region, &subtrahend);
-    pixman_region32_fini(&subtrahend);
+void wrei_region::clear()
+{
+    pixman_region32_clear(&region);
+}
+
+bool wrei_region::empty() const
+{
+    return !pixman_region32_not_empty(const_cast<pixman_region32_t*>(&region));
+}
+
+std::span<const pixman_box32_t> wrei_region::boxes() const
+{
+    int count;
+    auto* boxes = pixman_region32_rectangles(const_cast<pixman_region32_t*>(&region), &count);
+    return {boxes, usz(count)};
 }
 
 bool wrei_region::contains(wrei_vec2i32 point)
@@ -60,4 +60,29 @@ bool wrei_allocate_shm_file_pair(usz size, int* p_rw_fd, int* p_ro_fd)
     *p_rw_fd = rw_fd;
     *p_ro_fd = ro_fd;
     return true;
-}
\ No newline at end of file
+}
+
+int wrei_create_sealed_file(const char* name, std::span<const std::byte> data)
+{
+    int fd = wrei_unix_check_n1(memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    if (fd < 0) return -1;
+
+    usz written = 0;
+    while (written < data.size()) {
+        auto ret = write(fd, data.data() + written, data.size() - written);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) {
+            wrei_log_unix_error("create_sealed_file failed to write contents");
+            close(fd);
+            return -1;
+        }
+        written += usz(ret);
+    }
+
+    if (wrei_unix_check_n1(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
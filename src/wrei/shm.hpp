@@ -3,3 +3,7 @@
 #include "types.hpp"
 
 bool wrei_allocate_shm_file_pair(usz size, int* p_rw_fd, int* p_ro_fd);
+
+// Creates a memfd holding a copy of data, sealed against any further modification so that it can be shared
+// with clients directly. Returns -1 on failure
+int wrei_create_sealed_file(const char* name, std::span<const std::byte> data);
@@ -0,0 +1,73 @@
+#include "task_pool.hpp"
+
+static
+void wrei_task_pool_worker(std::stop_token stop, wrei_task_pool* pool)
+{
+    for (;;) {
+        std::function<void()> task;
+
+        {
+            std::unique_lock lock{pool->mutex};
+            if (!pool->cv.wait(lock, stop, [&] { return !pool->tasks.empty(); })) return;
+
+            task = std::move(pool->tasks.front());
+            pool->tasks.pop_front();
+            pool->running++;
+        }
+
+        task();
+
+        {
+            std::scoped_lock lock{pool->mutex};
+            pool->running--;
+        }
+
+        pool->cv.notify_all();
+    }
+}
+
+wrei_ref<wrei_task_pool> wrei_task_pool_create(u32 reserved_threads)
+{
+    auto pool = wrei_adopt_ref(new wrei_task_pool {});
+
+    u32 hardware_threads = std::thread::hardware_concurrency();
+    u32 count = hardware_threads > reserved_threads ? hardware_threads - reserved_threads : 0;
+
+    for (u32 i = 0; i < count; ++i) {
+        pool->workers.emplace_back(wrei_task_pool_worker, pool.get());
+    }
+
+    log_info("Task pool created with {} workers", count);
+
+    return pool;
+}
+
+wrei_task_pool::~wrei_task_pool()
+{
+    for (auto& worker : workers) {
+        worker.request_stop();
+    }
+    workers.clear();
+}
+
+void wrei_task_pool_submit(wrei_task_pool* pool, std::function<void()> task)
+{
+    if (pool->workers.empty()) {
+        task();
+        return;
+    }
+
+    {
+        std::scoped_lock lock{pool->mutex};
+        pool->tasks.emplace_back(std::move(task));
+    }
+
+    // Idle waiters share the condition variable, so wake everyone to guarantee a worker sees the task
+    pool->cv.notify_all();
+}
+
+void wrei_task_pool_wait_idle(wrei_task_pool* pool)
+{
+    std::unique_lock lock{pool->mutex};
+    pool->cv.wait(lock, [&] { return pool->tasks.empty() && !pool->running; });
+}
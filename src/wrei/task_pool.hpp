@@ -0,0 +1,28 @@
+#pragma once
+
+#include "ref.hpp"
+
+// Fixed set of worker threads executing tasks in submission order. Tasks must not touch
+// reference counted objects, and report completion back to their owner themselves
+
+struct wrei_task_pool : wrei_object
+{
+    std::vector<std::jthread> workers;
+
+    std::mutex mutex;
+    std::condition_variable_any cv;
+    std::deque<std::function<void()>> tasks;
+
+    // Tasks taken by a worker but not yet finished
+    u32 running;
+
+    ~wrei_task_pool();
+};
+
+// Creates one worker per hardware thread, less the given number reserved for other threads
+wrei_ref<wrei_task_pool> wrei_task_pool_create(u32 reserved_threads);
+
+void wrei_task_pool_submit(wrei_task_pool*, std::function<void()>);
+
+// Blocks until every submitted task has finished
+void wrei_task_pool_wait_idle(wrei_task_pool*);
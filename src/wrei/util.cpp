@@ -0,0 +1,12 @@
+#include "util.hpp"
+
+std::string wrei_duration_to_string(std::chrono::duration<f64, std::nano> dur)
+{
+    f64 ns = dur.count();
+    f64 abs = std::abs(ns);
+
+    if (abs >= 1e9) return std::format("{:.2f}s",  ns / 1e9);
+    if (abs >= 1e6) return std::format("{:.2f}ms", ns / 1e6);
+    if (abs >= 1e3) return std::format("{:.2f}us", ns / 1e3);
+    return std::format("{:.0f}ns", ns);
+}
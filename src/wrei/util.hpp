@@ -248,7 +248,16 @@ struct wrei_region
     ~wrei_region();
 
     void add(wrei_rect<i32>);
+    void add(const wrei_region&);
     void subtract(wrei_rect<i32>);
+    void subtract(const wrei_region&);
+    void intersect(wrei_rect<i32>);
+    void intersect(const wrei_region&);
+    void translate(wrei_vec2i32 offset);
+    void clear();
+
+    bool empty() const;
+    std::span<const pixman_box32_t> boxes() const;
 
     bool contains(wrei_vec2i32 point);
 };
\ No newline at end of file
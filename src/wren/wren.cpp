@@ -8,43 +8,200 @@ wren_context::~wren_context()
 {
     log_info("Wren context destroyed");
 
+    wren_wait_idle(this);
+    dmabuf_cache.clear();
+    for (auto& frame : frames) {
+        frame.objects.clear();
+        vk.DestroyCommandPool(device, frame.pool, nullptr);
+    }
+
+    for (auto& pooled : buffer_pool) {
+        vmaDestroyBuffer(vma, pooled.buffer, pooled.vma_allocation);
+    }
+    for (auto& pooled : image_pool) {
+        vk.DestroyImageView(device, pooled.view, nullptr);
+        vmaDestroyImage(vma, pooled.image, pooled.vma_allocation);
+    }
+    for (auto& deferred : deletion_queue) {
+        deferred.destroy();
+    }
+
+    if (staging.buffer) {
+        log_info("Staging ring high water: {} MiB of {} MiB", staging.high_water >> 20, staging.capacity >> 20);
+        vmaDestroyBuffer(vma, staging.buffer, staging.vma_allocation);
+    }
+
+    vk.DestroySemaphore(device, timeline, nullptr);
+
+    for (auto& conversion : ycbcr_conversions) {
+        vk.DestroyPipelineLayout(device, conversion->pipeline_layout, nullptr);
+        vk.DestroyDescriptorSetLayout(device, conversion->set_layout, nullptr);
+        vk.DestroySampler(device, conversion->sampler, nullptr);
+        vk.DestroySamplerYcbcrConversion(device, conversion->conversion, nullptr);
+    }
+    for (auto pool : ycbcr_descriptor_pools) {
+        vk.DestroyDescriptorPool(device, pool, nullptr);
+    }
+
+    vk.DestroyPipelineLayout(device, pipeline_layout, nullptr);
+    vk.DestroyDescriptorPool(device, descriptor_pool, nullptr);
+    vk.DestroyDescriptorSetLayout(device, set_layout, nullptr);
+    wren_sampler_destroy(this, sampler);
+
     vmaDestroyAllocator(vma);
 
-    vk.DestroyCommandPool(device, cmd_pool, nullptr);
     vk.DestroyDevice(device, nullptr);
     vk.DestroyInstance(instance, nullptr);
 }
 
-VkCommandBuffer wren_begin_commands(wren_context* ctx)
+void wren_frame_create(wren_context* ctx, wren_frame& frame)
 {
-    VkCommandBuffer cmd;
+    wren_check(ctx->vk.CreateCommandPool(ctx->device, wrei_ptr_to(VkCommandPoolCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = ctx->transfer_queue_family,
+    }), nullptr, &frame.pool));
+
     wren_check(ctx->vk.AllocateCommandBuffers(ctx->device, wrei_ptr_to(VkCommandBufferAllocateInfo {
         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .commandPool = ctx->cmd_pool,
+        .commandPool = frame.pool,
         .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
         .commandBufferCount = 1,
-    }), &cmd));
+    }), &frame.cmd));
+}
 
-    wren_check(ctx->vk.BeginCommandBuffer(cmd, wrei_ptr_to(VkCommandBufferBeginInfo {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-    })));
+VkCommandBuffer wren_commands(wren_context* ctx)
+{
+    auto& frame = ctx->frames[ctx->frame_index];
 
-    return cmd;
+    if (!frame.recording) {
+        wren_check(ctx->vk.BeginCommandBuffer(frame.cmd, wrei_ptr_to(VkCommandBufferBeginInfo {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+        })));
+        frame.recording = true;
+    }
+
+    return frame.cmd;
 }
 
-void wren_submit_commands(wren_context* ctx, VkCommandBuffer cmd)
+u64 wren_submit(wren_context* ctx, std::span<const VkSemaphoreSubmitInfo> waits)
 {
-    defer { ctx->vk.FreeCommandBuffers(ctx->device, ctx->cmd_pool, 1, &cmd); };
+    wren_flush_copies(ctx);
+
+    auto& frame = ctx->frames[ctx->frame_index];
 
-    wren_check(ctx->vk.EndCommandBuffer(cmd));
+    if (frame.recording) {
+        wren_check(ctx->vk.EndCommandBuffer(frame.cmd));
+    }
 
-    wren_check(ctx->vk.QueueSubmit2(ctx->queue, 1, wrei_ptr_to(VkSubmitInfo2 {
+    frame.timeline_value = ++ctx->timeline_value;
+
+    std::unique_lock queue_lock{ctx->transfer_queue == ctx->queue ? ctx->queue_mutex : ctx->transfer_queue_mutex};
+    wren_check(ctx->vk.QueueSubmit2(ctx->transfer_queue, 1, wrei_ptr_to(VkSubmitInfo2 {
         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
-        .commandBufferInfoCount = 1,
+        .waitSemaphoreInfoCount = u32(waits.size()),
+        .pWaitSemaphoreInfos = waits.data(),
+        .commandBufferInfoCount = frame.recording ? 1u : 0u,
         .pCommandBufferInfos = wrei_ptr_to(VkCommandBufferSubmitInfo {
             .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
-            .commandBuffer = cmd,
-        })
+            .commandBuffer = frame.cmd,
+        }),
+        .signalSemaphoreInfoCount = 1,
+        .pSignalSemaphoreInfos = wrei_ptr_to(VkSemaphoreSubmitInfo {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = ctx->timeline,
+            .value = frame.timeline_value,
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        }),
     }), nullptr));
-    wren_check(ctx->vk.QueueWaitIdle(ctx->queue));
+    queue_lock.unlock();
+
+    frame.recording = false;
+
+    // The frame may move when another is inserted below
+    u64 timeline_value = frame.timeline_value;
+
+    // Advance to the next frame, which is the oldest. If the GPU hasn't finished with it yet, insert a
+    // new frame ahead of it instead of blocking the submitting thread. Frames stay ordered by age
+
+    u64 completed = wren_get_completed_value(ctx);
+    ctx->frame_index = (ctx->frame_index + 1) % ctx->frames.size();
+    if (ctx->frames[ctx->frame_index].timeline_value > completed) {
+        ctx->frames.insert(ctx->frames.begin() + ctx->frame_index, wren_frame {});
+        wren_frame_create(ctx, ctx->frames[ctx->frame_index]);
+        log_debug("Growing wren frames to {}", ctx->frames.size());
+    } else {
+        auto& next = ctx->frames[ctx->frame_index];
+        wren_check(ctx->vk.ResetCommandPool(ctx->device, next.pool, 0));
+        next.objects.clear();
+    }
+
+    // Submissions are made from the thread that imports dmabufs, and stand in for frames
+    wren_dmabuf_cache_expire(ctx);
+
+    wren_poll(ctx);
+
+    return timeline_value;
+}
+
+u64 wren_pending_value(wren_context* ctx)
+{
+    return ctx->timeline_value + 1;
+}
+
+// Commands or copies have been recorded since the last submission
+bool wren_has_pending_work(wren_context* ctx)
+{
+    return ctx->frames[ctx->frame_index].recording || !ctx->pending_copies.empty();
+}
+
+void wren_keep_alive(wren_context* ctx, wrei_ref<wrei_object> object)
+{
+    ctx->frames[ctx->frame_index].objects.emplace_back(std::move(object));
+}
+
+u64 wren_get_completed_value(wren_context* ctx)
+{
+    u64 value = 0;
+    wren_check(ctx->vk.GetSemaphoreCounterValue(ctx->device, ctx->timeline, &value));
+    return value;
+}
+
+void wren_wait_idle(wren_context* ctx)
+{
+    {
+        std::scoped_lock lock{ctx->queue_mutex};
+        wren_check(ctx->vk.QueueWaitIdle(ctx->queue));
+    }
+
+    if (ctx->transfer_queue != ctx->queue) {
+        std::scoped_lock lock{ctx->transfer_queue_mutex};
+        wren_check(ctx->vk.QueueWaitIdle(ctx->transfer_queue));
+    }
+}
+
+void wren_defer_destroy(wren_context* ctx, std::function<void()> destroy)
+{
+    std::scoped_lock lock{ctx->mutex};
+    ctx->deletion_queue.emplace_back(wren_deferred_destroy {
+        .timeline_value = wren_pending_value(ctx),
+        .destroy = std::move(destroy),
+    });
+}
+
+void wren_poll(wren_context* ctx)
+{
+    std::scoped_lock lock{ctx->mutex};
+    if (ctx->deletion_queue.empty()) return;
+
+    u64 completed = wren_get_completed_value(ctx);
+
+    // Entries evicted from resource pools keep their original value, so the queue is not strictly ordered
+
+    std::erase_if(ctx->deletion_queue, [&](wren_deferred_destroy& deferred) {
+        if (deferred.timeline_value > completed) return false;
+        deferred.destroy();
+        return true;
+    });
 }
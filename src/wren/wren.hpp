@@ -4,6 +4,122 @@
 #include "wrei/types.hpp"
 
 #include "wren_functions.hpp"
+#include "wren_helpers.hpp"
+
+static constexpr u32 wren_frames_in_flight = 3;
+
+// All work recorded between two calls to wren_submit shares a single command buffer,
+// allocated from a pool that is reset wholesale once the frame has completed on the GPU.
+// Starts with wren_frames_in_flight frames, and grows instead of waiting when all are in use
+struct wren_frame
+{
+    VkCommandPool pool;
+    VkCommandBuffer cmd;
+    bool recording;
+
+    // Timeline value signalled when the frame's submission completes
+    u64 timeline_value;
+
+    // Objects that must outlive the GPU work of this frame
+    std::vector<wrei_ref<wrei_object>> objects;
+};
+
+// Resources released while the GPU may still be using them are held until the timeline
+// reaches the value of the submission that was open when they were released
+
+struct wren_deferred_destroy
+{
+    u64 timeline_value;
+    std::function<void()> destroy;
+};
+
+static constexpr u32 wren_max_pooled_buffers = 32;
+static constexpr u32 wren_max_pooled_images  = 64;
+
+// Images are allocated in size buckets, so that buffers recreated at slightly different sizes during
+// resizes and animations can reuse each other's images. The least recently returned images are evicted
+// once the pool exceeds its memory budget
+
+static constexpr u32 wren_image_size_granularity = 64;
+static constexpr usz wren_image_pool_budget = 256 * 1024 * 1024;
+
+// Cached dmabuf imports keep the client's memory alive, so the cache is kept small. The least recently
+// imported entries are evicted first, and images still used by a buffer live on until it is destroyed.
+// Once no buffer uses an entry it only lingers for a few submissions, which is enough for a client that
+// re-wraps the same dmabuf in a new wl_buffer, without pinning memory the client has moved on from
+
+static constexpr u32 wren_max_cached_dmabufs = 32;
+static constexpr usz wren_dmabuf_cache_budget = 512 * 1024 * 1024;
+static constexpr u64 wren_dmabuf_cache_expiry = 8;
+
+struct wren_pooled_buffer
+{
+    u64 timeline_value;
+
+    VkBuffer buffer;
+    VmaAllocation vma_allocation;
+    VkDeviceAddress device_address;
+    void* host_address;
+    usz size;
+};
+
+struct wren_pooled_image
+{
+    u64 timeline_value;
+
+    VkImage image;
+    VkImageView view;
+    VmaAllocation vma_allocation;
+    usz size;
+    VkExtent3D image_extent;
+    VkFormat format;
+    VkImageUsageFlags usage;
+    u32 descriptor;
+};
+
+// Buffer to image copies are collected until the next submission, so that the layout barriers
+// for every image uploaded in a batch can be recorded together around all of the copies
+
+struct wren_pending_copy
+{
+    VkImage image;
+    VkBuffer buffer;
+
+    // Discards the previous contents of the image
+    bool full;
+
+    std::vector<VkBufferImageCopy> regions;
+};
+
+// Persistently mapped ring buffer for upload staging data. Regions are sub-allocated linearly and
+// reclaimed once the submission that reads them has completed. The ring is replaced with a larger
+// one whenever an allocation doesn't fit. Only used from the recording thread
+
+static constexpr usz wren_staging_initial_capacity = 16 * 1024 * 1024;
+static constexpr usz wren_staging_alignment = 256;
+
+struct wren_staging_region
+{
+    u64 timeline_value;
+
+    // End offset of the region, the start is given by the end of the previous region
+    usz end;
+};
+
+struct wren_staging_ring
+{
+    VkBuffer buffer;
+    VmaAllocation vma_allocation;
+    void* host_address;
+    usz capacity;
+
+    usz head;
+    usz tail;
+    std::deque<wren_staging_region> regions;
+
+    // Most bytes ever in use at once
+    usz high_water;
+};
 
 struct wren_context : wrei_object
 {
@@ -12,6 +128,9 @@ struct wren_context : wrei_object
         WREN_DECLARE_FUNCTION(CreateInstance)
         WREN_INSTANCE_FUNCTIONS(WREN_DECLARE_FUNCTION)
         WREN_DEVICE_FUNCTIONS(  WREN_DECLARE_FUNCTION)
+
+        WREN_HOST_MEMORY_IMPORT_FUNCTIONS(WREN_DECLARE_FUNCTION)
+        WREN_HOST_IMAGE_COPY_FUNCTIONS(   WREN_DECLARE_FUNCTION)
     } vk;
 
     void* vulkan1;
@@ -27,13 +146,95 @@ struct wren_context : wrei_object
     u32 queue_family;
     VkQueue queue;
 
-    VkCommandPool cmd_pool;
-    VkCommandBuffer cmd;
+    // Guards access to the queue, which may be shared with other threads
+    std::mutex queue_mutex;
+
+    // Uploads are submitted to a dedicated transfer family or a second graphics queue where available,
+    // so that they can run alongside composition. Otherwise this aliases the graphics queue
+    u32 transfer_queue_family;
+    VkQueue transfer_queue;
+    std::mutex transfer_queue_mutex;
+
+    // Images are shared concurrently by both families when they differ, see wren_image_create
+    std::array<u32, 2> queue_families;
+
+    // Nanoseconds per timestamp query tick
+    f32 timestamp_period;
+
+    VkPhysicalDeviceType device_type;
+
+    // VK_EXT_external_memory_host, host pointers and sizes must be aligned to host_pointer_alignment
+    bool host_memory_import;
+    usz host_pointer_alignment;
+
+    // VK_EXT_host_image_copy, with GENERAL as a supported copy destination layout
+    bool host_image_copy;
+
+    // samplerYcbcrConversion, required to import multi-planar dmabufs
+    bool ycbcr_conversion;
+
+    // VK_EXT_physical_device_drm, the DRM node backing the device. Render node preferred over primary
+    bool has_drm_device;
+    dev_t drm_device;
+
+    // Signalled with an increasing value by every call to wren_submit
+    VkSemaphore timeline;
+    std::atomic<u64> timeline_value;
+
+    std::vector<wren_frame> frames;
+    u32 frame_index;
+
+    // Guards the deletion queue, resource pools and descriptor allocation, so that
+    // buffers and images may be created and released from any thread
+    std::mutex mutex;
+
+    std::vector<wren_deferred_destroy> deletion_queue;
+    std::vector<wren_pooled_buffer> buffer_pool;
+    std::vector<wren_pooled_image> image_pool;
+    usz image_pool_size;
+
+    // Only accessed from the thread that imports dmabufs
+    ankerl::unordered_dense::map<wren_dmabuf_key, wren_dmabuf_cache_entry, wren_dmabuf_key_hash> dmabuf_cache;
+    usz dmabuf_cache_size;
+    u64 dmabuf_cache_counter;
+
+    wren_staging_ring staging;
+
+    std::vector<wren_pending_copy> pending_copies;
+
+    VkSampler sampler;
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet set;
+    VkPipelineLayout pipeline_layout;
+
+    std::vector<u32> free_image_descriptors;
+    u32 image_descriptor_count;
+
+    // Only created from the thread that imports dmabufs, descriptor sets are allocated and freed under the mutex
+    std::vector<std::unique_ptr<wren_ycbcr_conversion>> ycbcr_conversions;
+    std::vector<VkDescriptorPool> ycbcr_descriptor_pools;
 
     ~wren_context();
 };
 
 wrei_ref<wren_context> wren_create();
 
-VkCommandBuffer wren_begin_commands( wren_context*);
-void            wren_submit_commands(wren_context*, VkCommandBuffer);
+// Command recording and submission are confined to the thread that owns the context
+
+void            wren_frame_create(wren_context*, wren_frame&);
+
+VkCommandBuffer wren_commands(wren_context*);
+u64             wren_submit(  wren_context*, std::span<const VkSemaphoreSubmitInfo> waits = {});
+
+// Records all pending copies into the current command buffer. Called by wren_submit
+void wren_flush_copies(wren_context*);
+
+u64  wren_pending_value(wren_context*);
+bool wren_has_pending_work(wren_context*);
+void wren_keep_alive(wren_context*, wrei_ref<wrei_object>);
+u64  wren_get_completed_value(wren_context*);
+void wren_wait_idle(wren_context*);
+
+void wren_defer_destroy(wren_context*, std::function<void()>);
+void wren_poll(wren_context*);
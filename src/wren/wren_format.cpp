@@ -4,19 +4,55 @@
 #include "wrei/util.hpp"
 
 static constexpr wren_format formats[] {
-	{
-		.drm = DRM_FORMAT_XRGB8888,
-		.vk = VK_FORMAT_B8G8R8A8_UNORM,
-		.vk_srgb = VK_FORMAT_B8G8R8A8_SRGB,
-	},
-
-	// The Vulkan _SRGB formats correspond to unpremultiplied alpha, but
-	// the Wayland protocol specifies premultiplied alpha on electrical values
-	{
-		.drm = DRM_FORMAT_ARGB8888,
-		.vk = VK_FORMAT_B8G8R8A8_UNORM,
-	},
 
+	// The Vulkan _SRGB formats correspond to unpremultiplied alpha, but the Wayland protocol specifies
+	// premultiplied alpha on electrical values, so only formats without alpha are given an sRGB variant
+
+	// 32-bit
+
+	{ .drm = DRM_FORMAT_XRGB8888,    .vk = VK_FORMAT_B8G8R8A8_UNORM,           .vk_srgb = VK_FORMAT_B8G8R8A8_SRGB, .texel_size = 4, .opaque = true },
+	{ .drm = DRM_FORMAT_ARGB8888,    .vk = VK_FORMAT_B8G8R8A8_UNORM,                                               .texel_size = 4 },
+	{ .drm = DRM_FORMAT_XBGR8888,    .vk = VK_FORMAT_R8G8B8A8_UNORM,           .vk_srgb = VK_FORMAT_R8G8B8A8_SRGB, .texel_size = 4, .opaque = true },
+	{ .drm = DRM_FORMAT_ABGR8888,    .vk = VK_FORMAT_R8G8B8A8_UNORM,                                               .texel_size = 4 },
+	{ .drm = DRM_FORMAT_XRGB2101010, .vk = VK_FORMAT_A2R10G10B10_UNORM_PACK32,                                     .texel_size = 4, .opaque = true },
+	{ .drm = DRM_FORMAT_ARGB2101010, .vk = VK_FORMAT_A2R10G10B10_UNORM_PACK32,                                     .texel_size = 4 },
+	{ .drm = DRM_FORMAT_XBGR2101010, .vk = VK_FORMAT_A2B10G10R10_UNORM_PACK32,                                     .texel_size = 4, .opaque = true },
+	{ .drm = DRM_FORMAT_ABGR2101010, .vk = VK_FORMAT_A2B10G10R10_UNORM_PACK32,                                     .texel_size = 4 },
+
+	// 24-bit
+
+	{ .drm = DRM_FORMAT_RGB888,      .vk = VK_FORMAT_B8G8R8_UNORM,             .vk_srgb = VK_FORMAT_B8G8R8_SRGB,   .texel_size = 3, .opaque = true },
+	{ .drm = DRM_FORMAT_BGR888,      .vk = VK_FORMAT_R8G8B8_UNORM,             .vk_srgb = VK_FORMAT_R8G8B8_SRGB,   .texel_size = 3, .opaque = true },
+
+	// 16-bit
+
+	{ .drm = DRM_FORMAT_RGB565,      .vk = VK_FORMAT_R5G6B5_UNORM_PACK16,                                          .texel_size = 2, .opaque = true },
+	{ .drm = DRM_FORMAT_BGR565,      .vk = VK_FORMAT_B5G6R5_UNORM_PACK16,                                          .texel_size = 2, .opaque = true },
+	{ .drm = DRM_FORMAT_XRGB1555,    .vk = VK_FORMAT_A1R5G5B5_UNORM_PACK16,                                        .texel_size = 2, .opaque = true },
+	{ .drm = DRM_FORMAT_ARGB1555,    .vk = VK_FORMAT_A1R5G5B5_UNORM_PACK16,                                        .texel_size = 2 },
+	{ .drm = DRM_FORMAT_RGBX5551,    .vk = VK_FORMAT_R5G5B5A1_UNORM_PACK16,                                        .texel_size = 2, .opaque = true },
+	{ .drm = DRM_FORMAT_RGBA5551,    .vk = VK_FORMAT_R5G5B5A1_UNORM_PACK16,                                        .texel_size = 2 },
+	{ .drm = DRM_FORMAT_BGRX5551,    .vk = VK_FORMAT_B5G5R5A1_UNORM_PACK16,                                        .texel_size = 2, .opaque = true },
+	{ .drm = DRM_FORMAT_BGRA5551,    .vk = VK_FORMAT_B5G5R5A1_UNORM_PACK16,                                        .texel_size = 2 },
+	{ .drm = DRM_FORMAT_XRGB4444,    .vk = VK_FORMAT_A4R4G4B4_UNORM_PACK16,                                        .texel_size = 2, .opaque = true },
+	{ .drm = DRM_FORMAT_ARGB4444,    .vk = VK_FORMAT_A4R4G4B4_UNORM_PACK16,                                        .texel_size = 2 },
+	{ .drm = DRM_FORMAT_RGBX4444,    .vk = VK_FORMAT_R4G4B4A4_UNORM_PACK16,                                        .texel_size = 2, .opaque = true },
+	{ .drm = DRM_FORMAT_RGBA4444,    .vk = VK_FORMAT_R4G4B4A4_UNORM_PACK16,                                        .texel_size = 2 },
+	{ .drm = DRM_FORMAT_BGRX4444,    .vk = VK_FORMAT_B4G4R4A4_UNORM_PACK16,                                        .texel_size = 2, .opaque = true },
+	{ .drm = DRM_FORMAT_BGRA4444,    .vk = VK_FORMAT_B4G4R4A4_UNORM_PACK16,                                        .texel_size = 2 },
+
+	// 64-bit
+
+	{ .drm = DRM_FORMAT_XBGR16161616,  .vk = VK_FORMAT_R16G16B16A16_UNORM,                                         .texel_size = 8, .opaque = true },
+	{ .drm = DRM_FORMAT_ABGR16161616,  .vk = VK_FORMAT_R16G16B16A16_UNORM,                                         .texel_size = 8 },
+	{ .drm = DRM_FORMAT_XBGR16161616F, .vk = VK_FORMAT_R16G16B16A16_SFLOAT,                                        .texel_size = 8, .opaque = true },
+	{ .drm = DRM_FORMAT_ABGR16161616F, .vk = VK_FORMAT_R16G16B16A16_SFLOAT,                                        .texel_size = 8 },
+
+	// YCbCr, multi-planar so only imported as dmabufs
+
+	{ .drm = DRM_FORMAT_NV12,   .vk = VK_FORMAT_G8_B8R8_2PLANE_420_UNORM,                  .opaque = true, .is_ycbcr = true },
+	{ .drm = DRM_FORMAT_P010,   .vk = VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16, .opaque = true, .is_ycbcr = true },
+	{ .drm = DRM_FORMAT_YUV420, .vk = VK_FORMAT_G8_B8_R8_3PLANE_420_UNORM,                 .opaque = true, .is_ycbcr = true },
 };
 
 std::span<const wren_format> wren_get_formats()
@@ -46,6 +82,20 @@ std::optional<wren_format> wren_find_format_from_drm(u32 drm_format)
     return std::nullopt;
 }
 
+bool wren_format_is_sampleable(wren_context* ctx, VkFormat format)
+{
+    VkFormatProperties2 props {
+        .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2,
+    };
+    ctx->vk.GetPhysicalDeviceFormatProperties2(ctx->physical_device, format, &props);
+
+    constexpr VkFormatFeatureFlags required = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT
+        | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT
+        | VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+
+    return (props.formatProperties.optimalTilingFeatures & required) == required;
+}
+
 void wren_enumerate_drm_modifiers(wren_context* ctx, const wren_format& format, std::vector<VkDrmFormatModifierProperties2EXT>& modifiers)
 {
     VkDrmFormatModifierPropertiesList2EXT mod_list = {
@@ -57,7 +107,6 @@ void wren_enumerate_drm_modifiers(wren_context* ctx, const wren_format& format,
     };
     ctx->vk.GetPhysicalDeviceFormatProperties2(ctx->physical_device, format.vk, &props);
 
-    log_info("Modifier count: {}", mod_list.drmFormatModifierCount);
     modifiers.resize(mod_list.drmFormatModifierCount);
 
     mod_list.pDrmFormatModifierProperties = modifiers.data();
@@ -65,125 +114,473 @@ void wren_enumerate_drm_modifiers(wren_context* ctx, const wren_format& format,
     ctx->vk.GetPhysicalDeviceFormatProperties2(ctx->physical_device, format.vk, &props);
 }
 
-wrei_ref<wren_image> wren_image_import_dmabuf(wren_context* ctx, const wren_dma_params& params)
+// Multi-planar images are only ever sampled. They are created disjoint when their planes live in separate
+// dmabufs, binding one allocation per plane, and otherwise bind a single allocation like any other image
+
+static
+VkImageUsageFlags wren_dmabuf_usage(const wren_format& format)
 {
-    auto image = wrei_adopt_ref(new wren_image {});
-    image->ctx = ctx;
+    return format.is_ycbcr ? VK_IMAGE_USAGE_SAMPLED_BIT : VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+}
 
-    image->extent = { params.extent.width, params.extent.height, 1 };
+static
+VkImageCreateFlags wren_dmabuf_create_flags(bool disjoint)
+{
+    return disjoint ? VK_IMAGE_CREATE_DISJOINT_BIT : 0;
+}
 
-    VkExternalMemoryHandleTypeFlagBits htype = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+static
+bool wren_dmabuf_planes_are_disjoint(const wren_dma_params& params)
+{
+    struct stat first;
+    if (fstat(params.planes.front().fd, &first) < 0) return true;
 
-    VkImageCreateInfo img_info {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-        .imageType = VK_IMAGE_TYPE_2D,
-        .format = params.format.vk,
-        .mipLevels = 1,
-        .arrayLayers = 1,
-        .samples = VK_SAMPLE_COUNT_1_BIT,
-        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .extent = image->extent,
-        .usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-    };
+    for (u32 i = 1; i < params.planes.size(); ++i) {
+        struct stat st;
+        if (fstat(params.planes[i].fd, &st) < 0 || st.st_dev != first.st_dev || st.st_ino != first.st_ino) return true;
+    }
+
+    return false;
+}
+
+bool wren_drm_modifier_is_importable(wren_context* ctx, const wren_format& format, u64 modifier, bool disjoint)
+{
+    if (format.is_ycbcr && !ctx->ycbcr_conversion) return false;
+
+    // Must match the image created by wren_image_import_dmabuf
 
-    VkExternalMemoryImageCreateInfo eimg = {
-        .sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
-        .handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+    VkExternalImageFormatProperties external_props {
+        .sType = VK_STRUCTURE_TYPE_EXTERNAL_IMAGE_FORMAT_PROPERTIES,
     };
-    img_info.pNext = &eimg;
+    auto res = ctx->vk.GetPhysicalDeviceImageFormatProperties2(ctx->physical_device, wrei_ptr_to(VkPhysicalDeviceImageFormatInfo2 {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2,
+        .pNext = wren_vk_make_chain_in({
+            wrei_ptr_to(VkPhysicalDeviceExternalImageFormatInfo {
+                .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_IMAGE_FORMAT_INFO,
+                .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+            }),
+            wrei_ptr_to(VkPhysicalDeviceImageDrmFormatModifierInfoEXT {
+                .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT,
+                .drmFormatModifier = modifier,
+                .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+            }),
+        }),
+        .format = format.vk,
+        .type = VK_IMAGE_TYPE_2D,
+        .tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT,
+        .usage = wren_dmabuf_usage(format),
+        .flags = wren_dmabuf_create_flags(disjoint),
+    }), wrei_ptr_to(VkImageFormatProperties2 {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2,
+        .pNext = &external_props,
+    }));
+
+    if (res != VK_SUCCESS) return false;
+
+    return external_props.externalMemoryProperties.externalMemoryFeatures & VK_EXTERNAL_MEMORY_FEATURE_IMPORTABLE_BIT;
+}
 
-    VkSubresourceLayout plane_layouts[wren_dma_max_planes] = {};
+// -----------------------------------------------------------------------------
 
-    img_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
-    for (u32 i = 0; i < params.planes.size(); ++i) {
-        plane_layouts[i].offset = params.planes[i].offset;
-        plane_layouts[i].rowPitch = params.planes[i].stride;
+wren_ycbcr_conversion* wren_get_ycbcr_conversion(wren_context* ctx, VkFormat format)
+{
+    if (!ctx->ycbcr_conversion) return nullptr;
+
+    for (auto& conversion : ctx->ycbcr_conversions) {
+        if (conversion->format == format) return conversion.get();
     }
 
-    VkImageDrmFormatModifierExplicitCreateInfoEXT mod_info = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT,
-        .drmFormatModifierPlaneCount = u32(params.planes.size()),
-        .drmFormatModifier = params.planes.front().drm_modifier,
-        .pPlaneLayouts = plane_layouts,
+    // Clients have no way to describe their color space yet, so assume BT.709 limited range, as produced by
+    // most video decoders. Chroma uses nearest filtering to match the main sampler, which every format supports
+
+    auto conversion = std::make_unique<wren_ycbcr_conversion>();
+    conversion->format = format;
+
+    auto destroy = [&] {
+        ctx->vk.DestroyPipelineLayout(ctx->device, conversion->pipeline_layout, nullptr);
+        ctx->vk.DestroyDescriptorSetLayout(ctx->device, conversion->set_layout, nullptr);
+        ctx->vk.DestroySampler(ctx->device, conversion->sampler, nullptr);
+        ctx->vk.DestroySamplerYcbcrConversion(ctx->device, conversion->conversion, nullptr);
+        return nullptr;
     };
-    eimg.pNext = &mod_info;
 
-    wren_check(ctx->vk.CreateImage(ctx->device, &img_info, nullptr, &image->image));
+    if (wren_check(ctx->vk.CreateSamplerYcbcrConversion(ctx->device, wrei_ptr_to(VkSamplerYcbcrConversionCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_YCBCR_CONVERSION_CREATE_INFO,
+        .format = format,
+        .ycbcrModel = VK_SAMPLER_YCBCR_MODEL_CONVERSION_YCBCR_709,
+        .ycbcrRange = VK_SAMPLER_YCBCR_RANGE_ITU_NARROW,
+        .xChromaOffset = VK_CHROMA_LOCATION_MIDPOINT,
+        .yChromaOffset = VK_CHROMA_LOCATION_MIDPOINT,
+        .chromaFilter = VK_FILTER_NEAREST,
+    }), nullptr, &conversion->conversion)) != VK_SUCCESS) return destroy();
+
+    if (wren_check(ctx->vk.CreateSampler(ctx->device, wrei_ptr_to(VkSamplerCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .pNext = wrei_ptr_to(VkSamplerYcbcrConversionInfo {
+            .sType = VK_STRUCTURE_TYPE_SAMPLER_YCBCR_CONVERSION_INFO,
+            .conversion = conversion->conversion,
+        }),
+        .magFilter = VK_FILTER_NEAREST,
+        .minFilter = VK_FILTER_NEAREST,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .anisotropyEnable = false,
+    }), nullptr, &conversion->sampler)) != VK_SUCCESS) return destroy();
+
+    if (wren_check(ctx->vk.CreateDescriptorSetLayout(ctx->device, wrei_ptr_to(VkDescriptorSetLayoutCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 1,
+        .pBindings = wrei_ptr_to(VkDescriptorSetLayoutBinding {
+            .binding = 0,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_ALL,
+            .pImmutableSamplers = &conversion->sampler,
+        }),
+    }), nullptr, &conversion->set_layout)) != VK_SUCCESS) return destroy();
+
+    std::array set_layouts { ctx->set_layout, conversion->set_layout };
+    if (wren_check(ctx->vk.CreatePipelineLayout(ctx->device, wrei_ptr_to(VkPipelineLayoutCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = u32(set_layouts.size()),
+        .pSetLayouts = set_layouts.data(),
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = wrei_ptr_to(VkPushConstantRange {
+            .stageFlags = VK_SHADER_STAGE_ALL,
+            .size = wren_push_constant_size,
+        }),
+    }), nullptr, &conversion->pipeline_layout)) != VK_SUCCESS) return destroy();
+
+    log_info("Created YCbCr conversion for {}", string_VkFormat(format));
+
+    return ctx->ycbcr_conversions.emplace_back(std::move(conversion)).get();
+}
 
-    VkBindImageMemoryInfo bindi = {};
+static
+bool wren_image_allocate_ycbcr_set(wren_image* image)
+{
+    auto* ctx = image->ctx;
+
+    std::scoped_lock lock{ctx->mutex};
+
+    auto allocate = [&](VkDescriptorPool pool) {
+        auto res = ctx->vk.AllocateDescriptorSets(ctx->device, wrei_ptr_to(VkDescriptorSetAllocateInfo {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = pool,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &image->ycbcr->set_layout,
+        }), &image->ycbcr_set);
+        if (res != VK_SUCCESS) {
+            image->ycbcr_set = nullptr;
+            return false;
+        }
+        image->ycbcr_pool = pool;
+        return true;
+    };
 
-    {
-        VkMemoryFdPropertiesKHR fdp = {
-            .sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR,
-        };
-        log_trace("  num_planes = {}", params.planes.size());
-        log_trace("  plane[0].fd = {}", params.planes.front().fd);
-        log_trace("  ctx->vk.GetMemoryFdPropertiesKHR = {}", (void*)ctx->vk.GetMemoryFdPropertiesKHR);
-        wren_check(ctx->vk.GetMemoryFdPropertiesKHR(ctx->device, htype, params.planes.front().fd, &fdp));
+    // Most recently created pools are the most likely to have free sets
 
-        VkImageMemoryRequirementsInfo2 memri = {
-            .image = image->image,
-            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2,
-        };
+    for (auto pool : ctx->ycbcr_descriptor_pools | std::views::reverse) {
+        if (allocate(pool)) break;
+    }
 
-        VkMemoryRequirements2 memr = {
-            .sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
-        };
+    if (!image->ycbcr_set) {
+        VkDescriptorPool pool;
+        if (wren_check(ctx->vk.CreateDescriptorPool(ctx->device, wrei_ptr_to(VkDescriptorPoolCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
+            .maxSets = wren_ycbcr_images_per_pool,
+            .poolSizeCount = 1,
+            .pPoolSizes = wrei_ptr_to(VkDescriptorPoolSize {
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, wren_ycbcr_images_per_pool * wren_max_ycbcr_descriptors_per_image,
+            }),
+        }), nullptr, &pool)) != VK_SUCCESS) return false;
+
+        ctx->ycbcr_descriptor_pools.emplace_back(pool);
+        log_debug("Created YCbCr descriptor pool {}", ctx->ycbcr_descriptor_pools.size());
+
+        if (!allocate(pool)) {
+            log_error("Failed to allocate YCbCr image descriptor set");
+            return false;
+        }
+    }
 
-        ctx->vk.GetImageMemoryRequirements2(ctx->device, &memri, &memr);
+    ctx->vk.UpdateDescriptorSets(ctx->device, 1, wrei_ptr_to(VkWriteDescriptorSet {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = image->ycbcr_set,
+        .dstBinding = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .pImageInfo = wrei_ptr_to(VkDescriptorImageInfo {
+            .imageView = image->view,
+            .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+        }),
+    }), 0, nullptr);
+
+    return true;
+}
 
-        auto mem = wren_find_vk_memory_type_index(ctx, memr.memoryRequirements.memoryTypeBits & fdp.memoryTypeBits, 0);
+// -----------------------------------------------------------------------------
 
-        int dfd = fcntl(params.planes.front().fd, F_DUPFD_CLOEXEC, 0);
+// Imports fd as the memory of the whole image, or of a single memory plane of a disjoint image
+static
+bool wren_import_dmabuf_memory(wren_context* ctx, wren_image* image, int fd, VkImageAspectFlagBits plane)
+{
+    VkExternalMemoryHandleTypeFlagBits htype = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
 
-        VkMemoryAllocateInfo memi = {
-            .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-            .allocationSize = memr.memoryRequirements.size,
-            .memoryTypeIndex = mem,
-        };
+    VkMemoryFdPropertiesKHR fdp = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR,
+    };
+    if (wren_check(ctx->vk.GetMemoryFdPropertiesKHR(ctx->device, htype, fd, &fdp)) != VK_SUCCESS) return false;
+
+    VkMemoryRequirements2 memr = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
+    };
+    ctx->vk.GetImageMemoryRequirements2(ctx->device, wrei_ptr_to(VkImageMemoryRequirementsInfo2 {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2,
+        .pNext = plane ? wrei_ptr_to(VkImagePlaneMemoryRequirementsInfo {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_PLANE_MEMORY_REQUIREMENTS_INFO,
+            .planeAspect = plane,
+        }) : nullptr,
+        .image = image->image,
+    }), &memr);
+
+    auto mem = wren_find_vk_memory_type_index(ctx, memr.memoryRequirements.memoryTypeBits & fdp.memoryTypeBits, 0);
+    if (mem == 0xFF) return false;
+
+    int dfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dfd < 0) return false;
+
+    // Disjoint images can't have dedicated allocations
+
+    VkMemoryDedicatedAllocateInfo dedicated = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO,
+        .image = image->image,
+    };
 
-        VkImportMemoryFdInfoKHR importi = {
+    // A successful import takes ownership of the fd
+
+    VkDeviceMemory memory;
+    if (wren_check(ctx->vk.AllocateMemory(ctx->device, wrei_ptr_to(VkMemoryAllocateInfo {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .pNext = wrei_ptr_to(VkImportMemoryFdInfoKHR {
             .sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR,
-            .fd = dfd,
+            .pNext = plane ? nullptr : &dedicated,
             .handleType = htype,
-        };
-        memi.pNext = &importi;
+            .fd = dfd,
+        }),
+        .allocationSize = memr.memoryRequirements.size,
+        .memoryTypeIndex = mem,
+    }), nullptr, &memory)) != VK_SUCCESS) {
+        close(dfd);
+        return false;
+    }
+    image->memory.emplace_back(memory);
+
+    return wren_check(ctx->vk.BindImageMemory2(ctx->device, 1, wrei_ptr_to(VkBindImageMemoryInfo {
+        .sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO,
+        .pNext = plane ? wrei_ptr_to(VkBindImagePlaneMemoryInfo {
+            .sType = VK_STRUCTURE_TYPE_BIND_IMAGE_PLANE_MEMORY_INFO,
+            .planeAspect = plane,
+        }) : nullptr,
+        .image = image->image,
+        .memory = memory,
+    }))) == VK_SUCCESS;
+}
 
-        VkMemoryDedicatedAllocateInfo dedi = {
-            .sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO,
-            .image = image->image,
-        };
-        importi.pNext = &dedi;
+static
+wrei_ref<wren_image> wren_image_import_dmabuf_uncached(wren_context* ctx, const wren_dma_params& params)
+{
+    auto& format = params.format;
 
-        wren_check(ctx->vk.AllocateMemory(ctx->device, &memi, nullptr, &image->memory));
+    // Only multi-planar formats can bind planes from separate dmabufs, everything else binds all of its
+    // planes from the memory imported through the first fd
 
-        bindi.image = image->image;
-        bindi.memory = image->memory;
-        bindi.memoryOffset = 0;
-        bindi.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO;
+    bool disjoint = wren_dmabuf_planes_are_disjoint(params);
+    if (disjoint && !format.is_ycbcr) {
+        log_error("Dmabuf planes in separate buffers are not supported");
+        return nullptr;
     }
 
-    wren_check(ctx->vk.BindImageMemory2(ctx->device, 1, &bindi));
+    // Formats are advertised by whether they import from a single dmabuf, not every modifier can be disjoint
 
-    {
-        auto cmd = wren_begin_commands(ctx);
+    if (disjoint && !wren_drm_modifier_is_importable(ctx, format, params.planes.front().drm_modifier, true)) {
+        log_error("Dmabuf modifier {:#x} does not support planes in separate buffers", params.planes.front().drm_modifier);
+        return nullptr;
+    }
 
-        wren_transition(ctx, cmd, image->image,
-            0, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
-            0, VK_ACCESS_2_MEMORY_WRITE_BIT | VK_ACCESS_2_MEMORY_READ_BIT,
-            VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+    auto image = wrei_adopt_ref(new wren_image {});
+    image->ctx = ctx;
 
-        wren_submit_commands(ctx, cmd);
+    if (format.is_ycbcr) {
+        image->ycbcr = wren_get_ycbcr_conversion(ctx, format.vk);
+        if (!image->ycbcr) return nullptr;
     }
 
-    wren_check(ctx->vk.CreateImageView(ctx->device, wrei_ptr_to(VkImageViewCreateInfo {
+    image->extent = { params.extent.width, params.extent.height, 1 };
+    image->image_extent = image->extent;
+    image->format = format.vk;
+    image->usage = wren_dmabuf_usage(format);
+
+    VkSubresourceLayout plane_layouts[wren_dma_max_planes] = {};
+    for (u32 i = 0; i < params.planes.size(); ++i) {
+        plane_layouts[i].offset = params.planes[i].offset;
+        plane_layouts[i].rowPitch = params.planes[i].stride;
+    }
+
+    // Imported images are only ever accessed on the graphics queue, including their initial transition
+
+    if (wren_check(ctx->vk.CreateImage(ctx->device, wrei_ptr_to(VkImageCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .pNext = wren_vk_make_chain_in({
+            wrei_ptr_to(VkExternalMemoryImageCreateInfo {
+                .sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+                .handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+            }),
+            wrei_ptr_to(VkImageDrmFormatModifierExplicitCreateInfoEXT {
+                .sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT,
+                .drmFormatModifier = params.planes.front().drm_modifier,
+                .drmFormatModifierPlaneCount = u32(params.planes.size()),
+                .pPlaneLayouts = plane_layouts,
+            }),
+        }),
+        .flags = wren_dmabuf_create_flags(disjoint),
+        .imageType = VK_IMAGE_TYPE_2D,
+        .format = format.vk,
+        .extent = image->extent,
+        .mipLevels = 1,
+        .arrayLayers = 1,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT,
+        .usage = image->usage,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    }), nullptr, &image->image)) != VK_SUCCESS) return nullptr;
+
+    if (disjoint) {
+        for (u32 i = 0; i < params.planes.size(); ++i) {
+            auto aspect = VkImageAspectFlagBits(VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT << i);
+            if (!wren_import_dmabuf_memory(ctx, image.get(), params.planes[i].fd, aspect)) return nullptr;
+        }
+    } else {
+        if (!wren_import_dmabuf_memory(ctx, image.get(), params.planes.front().fd, VkImageAspectFlagBits(0))) return nullptr;
+    }
+
+    // Nothing is recorded or submitted here, the first frame that samples the image performs the transition
+    image->layout_pending = true;
+
+    if (wren_check(ctx->vk.CreateImageView(ctx->device, wrei_ptr_to(VkImageViewCreateInfo {
         .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .pNext = image->ycbcr ? wrei_ptr_to(VkSamplerYcbcrConversionInfo {
+            .sType = VK_STRUCTURE_TYPE_SAMPLER_YCBCR_CONVERSION_INFO,
+            .conversion = image->ycbcr->conversion,
+        }) : nullptr,
         .image = image->image,
         .viewType = VK_IMAGE_VIEW_TYPE_2D,
-        .format = params.format.vk,
+        .format = format.vk,
         .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 },
-    }), nullptr, &image->view));
+    }), nullptr, &image->view)) != VK_SUCCESS) return nullptr;
+
+    if (image->ycbcr) {
+        if (!wren_image_allocate_ycbcr_set(image.get())) return nullptr;
+    } else {
+        wren_image_allocate_descriptor(image.get());
+    }
+
+    return image;
+}
+
+// -----------------------------------------------------------------------------
+
+static
+std::optional<wren_dmabuf_key> wren_dmabuf_key_from_params(const wren_dma_params& params)
+{
+    if (params.planes.empty() || params.planes.size() > wren_dma_max_planes) return std::nullopt;
+
+    wren_dmabuf_key key = {};
+    for (u32 i = 0; i < params.planes.size(); ++i) {
+        auto& plane = params.planes[i];
+
+        struct stat st;
+        if (fstat(plane.fd, &st) < 0) return std::nullopt;
+
+        key.planes[i] = { u64(st.st_dev), u64(st.st_ino), plane.offset, plane.stride };
+    }
+    key.plane_count = params.planes.size();
+    key.modifier = params.planes.front().drm_modifier;
+    key.format = params.format.drm;
+    key.extent = u64(params.extent.width) << 32 | params.extent.height;
+
+    return key;
+}
+
+static
+void wren_dmabuf_cache_evict(wren_context* ctx)
+{
+    while (ctx->dmabuf_cache.size() > wren_max_cached_dmabufs || ctx->dmabuf_cache_size > wren_dmabuf_cache_budget) {
+        auto oldest = std::ranges::min_element(ctx->dmabuf_cache, {}, [](const auto& entry) { return entry.second.last_use; });
+        ctx->dmabuf_cache_size -= oldest->second.size;
+        ctx->dmabuf_cache.erase(oldest);
+    }
+}
+
+wrei_ref<wren_image> wren_image_import_dmabuf(wren_context* ctx, const wren_dma_params& params)
+{
+    // An imported dmabuf holds a reference to its file, so the inode can't be reused while it is cached
+
+    auto key = wren_dmabuf_key_from_params(params);
+    if (!key) return wren_image_import_dmabuf_uncached(ctx, params);
+
+    if (auto it = ctx->dmabuf_cache.find(*key); it != ctx->dmabuf_cache.end()) {
+        it->second.last_use = ++ctx->dmabuf_cache_counter;
+        it->second.users++;
+        return it->second.image;
+    }
+
+    auto image = wren_image_import_dmabuf_uncached(ctx, params);
+    if (!image) return nullptr;
+
+    usz size = 0;
+    for (auto& plane : params.planes) {
+        size += usz(plane.stride) * params.extent.height;
+    }
+
+    ctx->dmabuf_cache.emplace(*key, wren_dmabuf_cache_entry {
+        .image = image,
+        .size = size,
+        .last_use = ++ctx->dmabuf_cache_counter,
+        .users = 1,
+        .released_value = 0,
+    });
+    ctx->dmabuf_cache_size += size;
+    wren_dmabuf_cache_evict(ctx);
 
     return image;
 }
+
+void wren_dmabuf_cache_release(wren_context* ctx, wren_image* image)
+{
+    // Entries may already have been evicted, or the import may not have been cacheable
+
+    auto it = std::ranges::find_if(ctx->dmabuf_cache, [&](const auto& entry) { return entry.second.image.get() == image; });
+    if (it == ctx->dmabuf_cache.end() || !it->second.users) return;
+
+    if (!--it->second.users) {
+        it->second.released_value = ctx->timeline_value;
+    }
+}
+
+void wren_dmabuf_cache_expire(wren_context* ctx)
+{
+    for (auto it = ctx->dmabuf_cache.begin(); it != ctx->dmabuf_cache.end();) {
+        auto& entry = it->second;
+        if (!entry.users && ctx->timeline_value >= entry.released_value + wren_dmabuf_cache_expiry) {
+            ctx->dmabuf_cache_size -= entry.size;
+            it = ctx->dmabuf_cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
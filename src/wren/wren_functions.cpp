@@ -25,4 +25,12 @@ void wren_load_instance_functions(wren_context* ctx)
 void wren_load_device_functions(wren_context* ctx)
 {
     WREN_DEVICE_FUNCTIONS(VULKAN_LOAD_DEVICE_FUNCTION)
+
+    if (ctx->host_memory_import) {
+        WREN_HOST_MEMORY_IMPORT_FUNCTIONS(VULKAN_LOAD_DEVICE_FUNCTION)
+    }
+
+    if (ctx->host_image_copy) {
+        WREN_HOST_IMAGE_COPY_FUNCTIONS(VULKAN_LOAD_DEVICE_FUNCTION)
+    }
 }
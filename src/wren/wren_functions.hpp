@@ -5,6 +5,7 @@
 #define WREN_INSTANCE_FUNCTIONS(DO) \
     DO(EnumeratePhysicalDevices) \
     DO(GetPhysicalDeviceProperties2) \
+    DO(GetPhysicalDeviceFeatures2) \
     DO(GetPhysicalDeviceQueueFamilyProperties) \
     DO(CreateDevice) \
     DO(GetDeviceProcAddr) \
@@ -15,6 +16,8 @@
     DO(DestroyInstance) \
     DO(GetPhysicalDeviceMemoryProperties) \
     DO(GetPhysicalDeviceFormatProperties2) \
+    DO(GetPhysicalDeviceImageFormatProperties2) \
+    DO(EnumerateDeviceExtensionProperties) \
     DO(CreateWaylandSurfaceKHR)
 
 #define WREN_DEVICE_FUNCTIONS(DO) \
@@ -47,6 +50,7 @@
     DO(QueueSubmit2) \
     DO(QueuePresentKHR) \
     DO(WaitSemaphores) \
+    DO(GetSemaphoreCounterValue) \
     DO(DestroyCommandPool) \
     DO(DestroySemaphore) \
     DO(DestroyPipelineLayout) \
@@ -55,6 +59,7 @@
     DO(DestroyFence) \
     DO(DestroyDescriptorPool) \
     DO(CmdClearColorImage) \
+    DO(CmdClearAttachments) \
     DO(ResetCommandPool) \
     DO(CreateBuffer) \
     DO(GetBufferMemoryRequirements) \
@@ -81,7 +86,15 @@
     DO(CmdBlitImage2) \
     DO(GetMemoryFdPropertiesKHR) \
     DO(GetImageMemoryRequirements2) \
-    DO(BindImageMemory2)
+    DO(BindImageMemory2) \
+    DO(CreateSamplerYcbcrConversion) \
+    DO(DestroySamplerYcbcrConversion) \
+    DO(FreeDescriptorSets) \
+    DO(CreateQueryPool) \
+    DO(DestroyQueryPool) \
+    DO(CmdResetQueryPool) \
+    DO(CmdWriteTimestamp2) \
+    DO(GetQueryPoolResults)
 
 #define WREN_DECLARE_FUNCTION(funcName, ...) PFN_vk##funcName funcName;
 
@@ -90,3 +103,12 @@ struct wren_context;
 void wren_init_functions(wren_context*, PFN_vkGetInstanceProcAddr);
 void wren_load_instance_functions(wren_context*);
 void wren_load_device_functions(wren_context*);
+
+// Only loaded when the corresponding optional extension is enabled
+
+#define WREN_HOST_MEMORY_IMPORT_FUNCTIONS(DO) \
+    DO(GetMemoryHostPointerPropertiesEXT)
+
+#define WREN_HOST_IMAGE_COPY_FUNCTIONS(DO) \
+    DO(CopyMemoryToImageEXT) \
+    DO(TransitionImageLayoutEXT)
@@ -64,6 +64,27 @@ wrei_ref<wren_buffer> wren_buffer_create(wren_context* ctx, usz size)
     auto buffer = wrei_adopt_ref(new wren_buffer {});
     buffer->ctx = ctx;
 
+    // Reuse a retired buffer of a similar size if one is available
+
+    u64 completed = wren_get_completed_value(ctx);
+    std::unique_lock lock{ctx->mutex};
+    for (auto it = ctx->buffer_pool.begin(); it != ctx->buffer_pool.end(); ++it) {
+        if (it->timeline_value > completed) continue;
+        if (it->size < size || it->size > size * 2) continue;
+
+        buffer->buffer = it->buffer;
+        buffer->vma_allocation = it->vma_allocation;
+        buffer->device_address = it->device_address;
+        buffer->host_address = it->host_address;
+        buffer->size = it->size;
+        ctx->buffer_pool.erase(it);
+
+        return buffer;
+    }
+    lock.unlock();
+
+    buffer->size = size;
+
     VmaAllocationInfo vma_alloc_info;
     wren_check(vmaCreateBuffer(ctx->vma, wrei_ptr_to(VkBufferCreateInfo {
         .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
@@ -93,29 +114,264 @@ wrei_ref<wren_buffer> wren_buffer_create(wren_context* ctx, usz size)
 
 wren_buffer::~wren_buffer()
 {
-    vmaDestroyBuffer(ctx->vma, buffer, vma_allocation);
+    // Return to the pool, evicting the oldest entry if full
+
+    std::scoped_lock lock{ctx->mutex};
+    ctx->buffer_pool.emplace_back(wren_pooled_buffer {
+        .timeline_value = wren_pending_value(ctx),
+        .buffer = buffer,
+        .vma_allocation = vma_allocation,
+        .device_address = device_address,
+        .host_address = host_address,
+        .size = size,
+    });
+
+    if (ctx->buffer_pool.size() > wren_max_pooled_buffers) {
+        auto evicted = ctx->buffer_pool.front();
+        ctx->buffer_pool.erase(ctx->buffer_pool.begin());
+
+        auto* c = ctx;
+        ctx->deletion_queue.emplace_back(wren_deferred_destroy {
+            .timeline_value = evicted.timeline_value,
+            .destroy = [c, evicted] {
+                vmaDestroyBuffer(c->vma, evicted.buffer, evicted.vma_allocation);
+            },
+        });
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+static
+void wren_staging_create(wren_context* ctx, usz capacity)
+{
+    auto& ring = ctx->staging;
+
+    VmaAllocationInfo vma_alloc_info;
+    wren_check(vmaCreateBuffer(ctx->vma, wrei_ptr_to(VkBufferCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = capacity,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    }), wrei_ptr_to(VmaAllocationCreateInfo {
+        .flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT,
+        .usage = VMA_MEMORY_USAGE_AUTO,
+        .requiredFlags = VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    }), &ring.buffer, &ring.vma_allocation, &vma_alloc_info));
+
+    ring.host_address = vma_alloc_info.pMappedData;
+    ring.capacity = capacity;
+    ring.head = 0;
+    ring.tail = 0;
+    ring.regions.clear();
+}
+
+wren_staging_allocation wren_staging_allocate(wren_context* ctx, usz size)
+{
+    auto& ring = ctx->staging;
+    size = (size + wren_staging_alignment - 1) & ~(wren_staging_alignment - 1);
+
+    // Reclaim regions read by completed submissions
+
+    u64 completed = wren_get_completed_value(ctx);
+    while (!ring.regions.empty() && ring.regions.front().timeline_value <= completed) {
+        ring.tail = ring.regions.front().end;
+        ring.regions.pop_front();
+    }
+    if (ring.regions.empty()) {
+        ring.head = 0;
+        ring.tail = 0;
+    }
+
+    // Free space is [head, capacity) + [0, tail) until the ring wraps, then [head, tail)
+
+    auto find_space = [&] -> std::optional<usz> {
+        if (!ring.buffer) return std::nullopt;
+        if (ring.regions.empty() || ring.head > ring.tail) {
+            if (ring.capacity - ring.head >= size) return ring.head;
+            if (ring.tail >= size) return 0;
+        } else if (ring.tail - ring.head >= size) {
+            return ring.head;
+        }
+        return std::nullopt;
+    };
+
+    auto offset = find_space();
+    if (!offset) {
+        usz capacity = std::max(wren_staging_initial_capacity, std::bit_ceil(size));
+
+        if (ring.buffer) {
+            capacity = std::max(capacity, ring.capacity * 2);
+
+            // Regions of the old ring may still be read by submitted work
+            wren_defer_destroy(ctx, [c = ctx, old_buffer = ring.buffer, old_allocation = ring.vma_allocation] {
+                vmaDestroyBuffer(c->vma, old_buffer, old_allocation);
+            });
+
+            log_info("Growing staging ring to {} MiB (high water: {} MiB)", capacity >> 20, ring.high_water >> 20);
+        }
+
+        wren_staging_create(ctx, capacity);
+        offset = 0;
+    }
+
+    // Allocations for the same submission share a single region
+
+    u64 timeline_value = wren_pending_value(ctx);
+    ring.head = *offset + size;
+    if (!ring.regions.empty() && ring.regions.back().timeline_value == timeline_value) {
+        ring.regions.back().end = ring.head;
+    } else {
+        ring.regions.emplace_back(wren_staging_region { .timeline_value = timeline_value, .end = ring.head });
+    }
+
+    usz used = ring.head > ring.tail ? ring.head - ring.tail : ring.capacity - ring.tail + ring.head;
+    ring.high_water = std::max(ring.high_water, used);
+
+    return {
+        .buffer = ring.buffer,
+        .offset = *offset,
+        .host_address = static_cast<char*>(ring.host_address) + *offset,
+    };
+}
+
+// -----------------------------------------------------------------------------
+
+wrei_ref<wren_host_buffer> wren_host_buffer_import(wren_context* ctx, void* data, usz size)
+{
+    if (!ctx->host_memory_import) return nullptr;
+
+    // The import size is rounded up to the import alignment, which must not reach past the end of the mapping
+
+    usz alignment = ctx->host_pointer_alignment;
+    usz page_size = usz(sysconf(_SC_PAGESIZE));
+    if (alignment > page_size || reinterpret_cast<uintptr_t>(data) % alignment) return nullptr;
+
+    usz aligned_size = (size + alignment - 1) & ~(alignment - 1);
+
+    // Failed imports fall back to staging uploads, so they aren't treated as errors
+
+    VkMemoryHostPointerPropertiesEXT host_props {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT,
+    };
+    if (auto res = ctx->vk.GetMemoryHostPointerPropertiesEXT(ctx->device,
+            VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, data, &host_props); res != VK_SUCCESS) {
+        log_debug("Host pointer can't be imported ({}), using staging uploads", wren_result_to_string(res));
+        return nullptr;
+    }
+
+    auto buffer = wrei_adopt_ref(new wren_host_buffer {});
+    buffer->ctx = ctx;
+    buffer->size = size;
+
+    wren_check(ctx->vk.CreateBuffer(ctx->device, wrei_ptr_to(VkBufferCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .pNext = wrei_ptr_to(VkExternalMemoryBufferCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO,
+            .handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+        }),
+        .size = aligned_size,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    }), nullptr, &buffer->buffer));
+
+    VkMemoryRequirements mem_reqs;
+    ctx->vk.GetBufferMemoryRequirements(ctx->device, buffer->buffer, &mem_reqs);
+
+    u32 type_bits = mem_reqs.memoryTypeBits & host_props.memoryTypeBits;
+    if (!type_bits) {
+        log_debug("No memory type for host pointer import, using staging uploads");
+        return nullptr;
+    }
+
+    if (auto res = ctx->vk.AllocateMemory(ctx->device, wrei_ptr_to(VkMemoryAllocateInfo {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .pNext = wrei_ptr_to(VkImportMemoryHostPointerInfoEXT {
+            .sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT,
+            .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+            .pHostPointer = data,
+        }),
+        .allocationSize = aligned_size,
+        .memoryTypeIndex = u32(std::countr_zero(type_bits)),
+    }), nullptr, &buffer->memory); res != VK_SUCCESS) {
+        log_debug("Host pointer import failed ({}), using staging uploads", wren_result_to_string(res));
+        return nullptr;
+    }
+
+    wren_check(ctx->vk.BindBufferMemory(ctx->device, buffer->buffer, buffer->memory, 0));
+
+    return buffer;
+}
+
+wren_host_buffer::~wren_host_buffer()
+{
+    wren_defer_destroy(ctx, [c = ctx, vk_buffer = buffer, vk_memory = memory] {
+        c->vk.DestroyBuffer(c->device, vk_buffer, nullptr);
+        c->vk.FreeMemory(c->device, vk_memory, nullptr);
+    });
 }
 
 // -----------------------------------------------------------------------------
 
-wrei_ref<wren_image> wren_image_create(wren_context* ctx, VkExtent2D extent, VkFormat format)
+// Only called from deferred destruction, with the context mutex held
+static
+void wren_free_image_descriptor(wren_context* ctx, u32 descriptor)
+{
+    if (descriptor != ~0u) {
+        ctx->free_image_descriptors.emplace_back(descriptor);
+    }
+}
+
+wrei_ref<wren_image> wren_image_create(wren_context* ctx, VkExtent2D extent, VkFormat format, VkImageUsageFlags extra_usage)
 {
     auto image = wrei_adopt_ref(new wren_image {});
     image->ctx = ctx;
 
+    auto round_up = [](u32 v) { return (v + wren_image_size_granularity - 1) / wren_image_size_granularity * wren_image_size_granularity; };
+
     image->extent = { extent.width, extent.height, 1 };
+    image->image_extent = { round_up(extent.width), round_up(extent.height), 1 };
+    image->format = format;
+    image->usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | extra_usage;
+
+    // Reuse the most recently retired image from the same bucket, including its view and descriptor
+
+    u64 completed = wren_get_completed_value(ctx);
+    std::unique_lock lock{ctx->mutex};
+    for (auto it = ctx->image_pool.rbegin(); it != ctx->image_pool.rend(); ++it) {
+        if (it->timeline_value > completed) continue;
+        if (it->format != format || it->usage != image->usage) continue;
+        if (it->image_extent.width != image->image_extent.width || it->image_extent.height != image->image_extent.height) continue;
+
+        image->image = it->image;
+        image->view = it->view;
+        image->vma_allocation = it->vma_allocation;
+        image->descriptor = it->descriptor;
+        ctx->image_pool_size -= it->size;
+        ctx->image_pool.erase(std::next(it).base());
+
+        return image;
+    }
+    lock.unlock();
+
+    // Images are written on the transfer queue and sampled on the graphics queue. Sharing them concurrently
+    // avoids a pair of ownership transfers around every in place update that must preserve the old contents
+
+    bool concurrent = ctx->transfer_queue_family != ctx->queue_family;
 
     wren_check(vmaCreateImage(ctx->vma, wrei_ptr_to(VkImageCreateInfo {
         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
         .imageType = VK_IMAGE_TYPE_2D,
         .format = format,
-        .extent = image->extent,
+        .extent = image->image_extent,
         .mipLevels = 1,
         .arrayLayers = 1,
         .samples = VK_SAMPLE_COUNT_1_BIT,
         .tiling = VK_IMAGE_TILING_OPTIMAL,
-        .usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .usage = image->usage,
+        .sharingMode = concurrent ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+        .queueFamilyIndexCount = concurrent ? u32(ctx->queue_families.size()) : 0u,
+        .pQueueFamilyIndices = ctx->queue_families.data(),
         .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
     }), wrei_ptr_to(VmaAllocationCreateInfo {
         .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
@@ -129,58 +385,321 @@ wrei_ref<wren_image> wren_image_create(wren_context* ctx, VkExtent2D extent, VkF
         .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 },
     }), nullptr, &image->view));
 
+    wren_image_allocate_descriptor(image.get());
+
     return image;
 }
 
+void wren_image_allocate_descriptor(wren_image* image)
+{
+    auto* ctx = image->ctx;
+
+    std::scoped_lock lock{ctx->mutex};
+    if (!ctx->free_image_descriptors.empty()) {
+        image->descriptor = ctx->free_image_descriptors.back();
+        ctx->free_image_descriptors.pop_back();
+    } else if (ctx->image_descriptor_count < wren_max_image_descriptors) {
+        image->descriptor = ctx->image_descriptor_count++;
+    } else {
+        log_error("Exhausted bindless image descriptors ({})", wren_max_image_descriptors);
+        return;
+    }
 
-void wren_image_update(wren_image* image, const void* data)
+    ctx->vk.UpdateDescriptorSets(ctx->device, 1, wrei_ptr_to(VkWriteDescriptorSet {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = ctx->set,
+        .dstBinding = 0,
+        .dstArrayElement = image->descriptor,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+        .pImageInfo = wrei_ptr_to(VkDescriptorImageInfo {
+            .imageView = image->view,
+            .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+        }),
+    }), 0, nullptr);
+}
+
+static
+bool wren_is_full_update(wren_image* image, std::span<const VkRect2D> rects)
+{
+    return rects.size() == 1
+        && rects[0].offset.x == 0 && rects[0].offset.y == 0
+        && rects[0].extent.width == image->extent.width && rects[0].extent.height == image->extent.height;
+}
+
+static
+void wren_image_record_copy(wren_image* image, VkBuffer buffer, std::span<const VkBufferImageCopy> regions, bool full)
 {
     auto* ctx = image->ctx;
+
+    // Copies into the same image must be ordered by a barrier, so flush any already in this batch first
+
+    if (std::ranges::contains(ctx->pending_copies, image->image, &wren_pending_copy::image)) {
+        wren_flush_copies(ctx);
+    }
+
+    ctx->pending_copies.emplace_back(wren_pending_copy {
+        .image = image->image,
+        .buffer = buffer,
+        .full = full,
+        .regions = {regions.begin(), regions.end()},
+    });
+}
+
+void wren_flush_copies(wren_context* ctx)
+{
+    if (ctx->pending_copies.empty()) return;
+
+    auto cmd = wren_commands(ctx);
+
+    // Previously submitted frames may still be sampling from the images. Full updates discard the old contents
+
+    std::vector<VkImageMemoryBarrier2> barriers;
+    for (auto& copy : ctx->pending_copies) {
+        barriers.emplace_back(VkImageMemoryBarrier2 {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+            .srcAccessMask = 0,
+            .dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+            .dstAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT | VK_ACCESS_2_MEMORY_READ_BIT,
+            .oldLayout = copy.full ? VK_IMAGE_LAYOUT_UNDEFINED : VK_IMAGE_LAYOUT_GENERAL,
+            .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = copy.image,
+            .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 },
+        });
+    }
+
+    auto record_barriers = [&] {
+        ctx->vk.CmdPipelineBarrier2(cmd, wrei_ptr_to(VkDependencyInfo {
+            .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+            .imageMemoryBarrierCount = u32(barriers.size()),
+            .pImageMemoryBarriers = barriers.data(),
+        }));
+    };
+
+    record_barriers();
+
+    for (auto& copy : ctx->pending_copies) {
+        ctx->vk.CmdCopyBufferToImage(cmd, copy.buffer, copy.image, VK_IMAGE_LAYOUT_GENERAL, u32(copy.regions.size()), copy.regions.data());
+    }
+
+    for (auto& barrier : barriers) {
+        barrier.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+    }
+
+    record_barriers();
+
+    ctx->pending_copies.clear();
+}
+
+void wren_image_update(wren_image* image, const void* data)
+{
     auto extent = image->extent;
+    usz pixel_size = wren_find_format_from_vulkan(image->format)->texel_size;
+    wren_image_update_rects(image, data, extent.width * pixel_size, std::array { VkRect2D { {}, { extent.width, extent.height } } });
+}
+
+void wren_image_update_rects(wren_image* image, const void* data, usz stride, std::span<const VkRect2D> rects, const wrei_pixel_converter* converter)
+{
+    auto* ctx = image->ctx;
+
+    usz pixel_size = wren_find_format_from_vulkan(image->format)->texel_size;
+    usz src_pixel_size = converter ? converter->src_size : pixel_size;
+
+    if (rects.empty()) return;
+
+    // Rectangles covering most of a row are staged as a single copy that keeps the source stride,
+    // narrower ones are packed row by row to avoid staging the untouched pixels in between.
+    // Converted rows are always packed, as the source stride doesn't apply to the converted pixels
+
+    auto is_strided = [&](const VkRect2D& rect) {
+        return !converter && rect.extent.width * pixel_size * 2 >= stride;
+    };
+
+    auto staged_size = [&](const VkRect2D& rect) -> usz {
+        usz row_size = rect.extent.width * pixel_size;
+        return is_strided(rect) ? (rect.extent.height - 1) * stride + row_size : rect.extent.height * row_size;
+    };
 
-    auto cmd = wren_begin_commands(ctx);
+    usz total_size = 0;
+    for (auto& rect : rects) {
+        total_size += (staged_size(rect) + wren_staging_alignment - 1) & ~(wren_staging_alignment - 1);
+    }
 
-    constexpr auto pixel_size = 4;
-    auto row_length = extent.width;
-    auto image_height = row_length * extent.height;
-    auto image_size = image_height * pixel_size;
+    auto staging = wren_staging_allocate(ctx, total_size);
+
+    std::vector<VkBufferImageCopy> regions;
+    usz offset = 0;
+    for (auto& rect : rects) {
+        usz row_size = rect.extent.width * pixel_size;
+        auto* src = static_cast<const char*>(data) + rect.offset.y * stride + rect.offset.x * src_pixel_size;
+        auto* dst = static_cast<char*>(staging.host_address) + offset;
+
+        if (converter) {
+            for (u32 y = 0; y < rect.extent.height; ++y) {
+                converter->convert(dst + y * row_size, src + y * stride, rect.extent.width);
+            }
+        } else if (is_strided(rect)) {
+            std::memcpy(dst, src, staged_size(rect));
+        } else {
+            for (u32 y = 0; y < rect.extent.height; ++y) {
+                std::memcpy(dst + y * row_size, src + y * stride, row_size);
+            }
+        }
+
+        regions.emplace_back(VkBufferImageCopy {
+            .bufferOffset = staging.offset + offset,
+            .bufferRowLength = is_strided(rect) ? u32(stride / pixel_size) : 0u,
+            .bufferImageHeight = 0,
+            .imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+            .imageOffset = { rect.offset.x, rect.offset.y, 0 },
+            .imageExtent = { rect.extent.width, rect.extent.height, 1 },
+        });
+
+        offset += (staged_size(rect) + wren_staging_alignment - 1) & ~(wren_staging_alignment - 1);
+    }
 
-    // TODO: This should be stored persistently for transfers
-    wrei_ref buffer = wren_buffer_create(ctx, image_size);
+    wren_image_record_copy(image, staging.buffer, regions, wren_is_full_update(image, rects));
+}
 
-    std::memcpy(buffer->host_address, data, image_size);
+void wren_image_copy_rects(wren_image* image, VkBuffer buffer, usz offset, usz stride, std::span<const VkRect2D> rects, u32 first_row)
+{
+    usz pixel_size = wren_find_format_from_vulkan(image->format)->texel_size;
+
+    if (rects.empty()) return;
+
+    std::vector<VkBufferImageCopy> regions;
+    for (auto& rect : rects) {
+        regions.emplace_back(VkBufferImageCopy {
+            .bufferOffset = offset + (rect.offset.y - first_row) * stride + rect.offset.x * pixel_size,
+            .bufferRowLength = u32(stride / pixel_size),
+            .bufferImageHeight = 0,
+            .imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+            .imageOffset = { rect.offset.x, rect.offset.y, 0 },
+            .imageExtent = { rect.extent.width, rect.extent.height, 1 },
+        });
+    }
 
-    wren_transition(ctx, cmd, image->image,
-        0, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
-        0, VK_ACCESS_2_MEMORY_WRITE_BIT | VK_ACCESS_2_MEMORY_READ_BIT,
-        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    wren_image_record_copy(image, buffer, regions, wren_is_full_update(image, rects));
+}
 
-    ctx->vk.CmdCopyBufferToImage(cmd, buffer->buffer, image->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, wrei_ptr_to(VkBufferImageCopy {
-        .bufferOffset = 0,
-        .bufferRowLength = row_length,
-        .bufferImageHeight = image_size,
-        .imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
-        .imageOffset = {},
-        .imageExtent = { extent.width, extent.height, 1 },
+bool wren_image_host_copy_supported(wren_context* ctx, VkFormat format)
+{
+    if (!ctx->host_image_copy) return false;
+
+    VkFormatProperties3 props3 {
+        .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_3,
+    };
+    ctx->vk.GetPhysicalDeviceFormatProperties2(ctx->physical_device, format, wrei_ptr_to(VkFormatProperties2 {
+        .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2,
+        .pNext = &props3,
     }));
 
-    wren_transition(ctx, cmd, image->image,
-        0, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
-        0, VK_ACCESS_2_MEMORY_WRITE_BIT | VK_ACCESS_2_MEMORY_READ_BIT,
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL);
+    return props3.optimalTilingFeatures & VK_FORMAT_FEATURE_2_HOST_IMAGE_TRANSFER_BIT_EXT;
+}
+
+void wren_image_host_copy_rects(wren_image* image, const void* data, usz stride, std::span<const VkRect2D> rects)
+{
+    auto* ctx = image->ctx;
 
-    wren_submit_commands(ctx, cmd);
+    usz pixel_size = wren_find_format_from_vulkan(image->format)->texel_size;
+
+    if (rects.empty()) return;
+
+    // Full updates discard the old contents, and are also responsible for the initial layout transition
+
+    if (wren_is_full_update(image, rects)) {
+        wren_check(ctx->vk.TransitionImageLayoutEXT(ctx->device, 1, wrei_ptr_to(VkHostImageLayoutTransitionInfoEXT {
+            .sType = VK_STRUCTURE_TYPE_HOST_IMAGE_LAYOUT_TRANSITION_INFO_EXT,
+            .image = image->image,
+            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+            .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 },
+        })));
+    }
+
+    std::vector<VkMemoryToImageCopyEXT> regions;
+    for (auto& rect : rects) {
+        regions.emplace_back(VkMemoryToImageCopyEXT {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_TO_IMAGE_COPY_EXT,
+            .pHostPointer = static_cast<const char*>(data) + rect.offset.y * stride + rect.offset.x * pixel_size,
+            .memoryRowLength = u32(stride / pixel_size),
+            .memoryImageHeight = 0,
+            .imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+            .imageOffset = { rect.offset.x, rect.offset.y, 0 },
+            .imageExtent = { rect.extent.width, rect.extent.height, 1 },
+        });
+    }
+
+    // Host writes are made visible to the device by the next queue submission
+
+    wren_check(ctx->vk.CopyMemoryToImageEXT(ctx->device, wrei_ptr_to(VkCopyMemoryToImageInfoEXT {
+        .sType = VK_STRUCTURE_TYPE_COPY_MEMORY_TO_IMAGE_INFO_EXT,
+        .dstImage = image->image,
+        .dstImageLayout = VK_IMAGE_LAYOUT_GENERAL,
+        .regionCount = u32(regions.size()),
+        .pRegions = regions.data(),
+    })));
 }
 
 wren_image::~wren_image()
 {
-    ctx->vk.DestroyImageView(ctx->device, view, nullptr);
+    auto* c = ctx;
+
+    std::scoped_lock lock{ctx->mutex};
+
+    if (!vma_allocation) {
+        // Imported images own their memory and can't be pooled
+
+        ctx->deletion_queue.emplace_back(wren_deferred_destroy {
+            .timeline_value = wren_pending_value(ctx),
+            .destroy = [c, vk_image = image, vk_view = view, vk_memory = std::move(memory), slot = descriptor, set = ycbcr_set, pool = ycbcr_pool] {
+                wren_free_image_descriptor(c, slot);
+                if (set) c->vk.FreeDescriptorSets(c->device, pool, 1, &set);
+                c->vk.DestroyImageView(c->device, vk_view, nullptr);
+                c->vk.DestroyImage(c->device, vk_image, nullptr);
+                for (auto m : vk_memory) {
+                    c->vk.FreeMemory(c->device, m, nullptr);
+                }
+            },
+        });
+        return;
+    }
 
-    if (vma_allocation) {
-        vmaDestroyImage(ctx->vma, image, vma_allocation);
-    } else {
-        ctx->vk.DestroyImage(ctx->device, image, nullptr);
-        ctx->vk.FreeMemory(ctx->device, memory, nullptr);
+    // Return to the pool, evicting the least recently returned entries while over budget
+
+    VmaAllocationInfo alloc_info;
+    vmaGetAllocationInfo(ctx->vma, vma_allocation, &alloc_info);
+
+    ctx->image_pool.emplace_back(wren_pooled_image {
+        .timeline_value = wren_pending_value(ctx),
+        .image = image,
+        .view = view,
+        .vma_allocation = vma_allocation,
+        .size = usz(alloc_info.size),
+        .image_extent = image_extent,
+        .format = format,
+        .usage = usage,
+        .descriptor = descriptor,
+    });
+    ctx->image_pool_size += alloc_info.size;
+
+    while (ctx->image_pool.size() > wren_max_pooled_images || ctx->image_pool_size > wren_image_pool_budget) {
+        auto evicted = ctx->image_pool.front();
+        ctx->image_pool.erase(ctx->image_pool.begin());
+        ctx->image_pool_size -= evicted.size;
+
+        ctx->deletion_queue.emplace_back(wren_deferred_destroy {
+            .timeline_value = evicted.timeline_value,
+            .destroy = [c, evicted] {
+                wren_free_image_descriptor(c, evicted.descriptor);
+                c->vk.DestroyImageView(c->device, evicted.view, nullptr);
+                vmaDestroyImage(c->vma, evicted.image, evicted.vma_allocation);
+            },
+        });
     }
 }
 
@@ -211,3 +730,107 @@ void wren_sampler_destroy(wren_context* ctx, VkSampler sampler)
 {
     ctx->vk.DestroySampler(ctx->device, sampler, nullptr);
 }
+
+// -----------------------------------------------------------------------------
+
+VkPipeline wren_pipeline_create(wren_context* ctx, const wren_pipeline_info& info)
+{
+    auto vertex_module = VkShaderModuleCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+        .codeSize = info.vertex_spirv.size_bytes(),
+        .pCode = info.vertex_spirv.data(),
+    };
+
+    auto fragment_module = VkShaderModuleCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+        .codeSize = info.fragment_spirv.size_bytes(),
+        .pCode = info.fragment_spirv.data(),
+    };
+
+    // Shader modules are passed inline (VK_KHR_maintenance5)
+
+    std::array stages {
+        VkPipelineShaderStageCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .pNext = &vertex_module,
+            .stage = VK_SHADER_STAGE_VERTEX_BIT,
+            .pName = "main",
+        },
+        VkPipelineShaderStageCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .pNext = &fragment_module,
+            .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .pName = "main",
+        },
+    };
+
+    std::array dynamic_states {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR,
+    };
+
+    // Client buffers are premultiplied
+
+    auto blend = VkPipelineColorBlendAttachmentState {
+        .blendEnable = info.blend,
+        .srcColorBlendFactor = VK_BLEND_FACTOR_ONE,
+        .dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+        .colorBlendOp = VK_BLEND_OP_ADD,
+        .srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
+        .dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+        .alphaBlendOp = VK_BLEND_OP_ADD,
+        .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
+    };
+
+    VkPipeline pipeline;
+    wren_check(ctx->vk.CreateGraphicsPipelines(ctx->device, nullptr, 1, wrei_ptr_to(VkGraphicsPipelineCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        .pNext = wrei_ptr_to(VkPipelineRenderingCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO,
+            .colorAttachmentCount = 1,
+            .pColorAttachmentFormats = &info.format,
+        }),
+        .stageCount = u32(stages.size()),
+        .pStages = stages.data(),
+        .pVertexInputState = wrei_ptr_to(VkPipelineVertexInputStateCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+        }),
+        .pInputAssemblyState = wrei_ptr_to(VkPipelineInputAssemblyStateCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+            .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP,
+        }),
+        .pViewportState = wrei_ptr_to(VkPipelineViewportStateCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+            .viewportCount = 1,
+            .scissorCount = 1,
+        }),
+        .pRasterizationState = wrei_ptr_to(VkPipelineRasterizationStateCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+            .polygonMode = VK_POLYGON_MODE_FILL,
+            .cullMode = VK_CULL_MODE_NONE,
+            .lineWidth = 1.f,
+        }),
+        .pMultisampleState = wrei_ptr_to(VkPipelineMultisampleStateCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+            .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+        }),
+        .pColorBlendState = wrei_ptr_to(VkPipelineColorBlendStateCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+            .attachmentCount = 1,
+            .pAttachments = &blend,
+        }),
+        .pDynamicState = wrei_ptr_to(VkPipelineDynamicStateCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+            .dynamicStateCount = u32(dynamic_states.size()),
+            .pDynamicStates = dynamic_states.data(),
+        }),
+        .layout = info.layout ? info.layout : ctx->pipeline_layout,
+    }), nullptr, &pipeline));
+
+    return pipeline;
+}
+
+void wren_pipeline_destroy(wren_context* ctx, VkPipeline pipeline)
+{
+    ctx->vk.DestroyPipeline(ctx->device, pipeline, nullptr);
+}
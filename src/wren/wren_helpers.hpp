@@ -3,6 +3,7 @@
 #include "wrei/types.hpp"
 #include "wrei/log.hpp"
 #include "wrei/ref.hpp"
+#include "wrei/pixel.hpp"
 
 struct wren_context;
 
@@ -35,10 +36,12 @@ void wren_vk_enumerate(Container& container, Fn&& fn, Args&&... args)
     }
 }
 
+// Links structures in order, with the last structure first in the chain and
+// the optional tail (which may already be the head of a chain) at the end
 inline
-auto wren_vk_make_chain_in(std::span<void* const> structures)
+auto wren_vk_make_chain_in(std::span<void* const> structures, void* tail = nullptr)
 {
-    VkBaseInStructure* last = nullptr;
+    auto* last = static_cast<VkBaseInStructure*>(tail);
     for (auto* s : structures) {
         auto vk_base = static_cast<VkBaseInStructure*>(s);
         vk_base->pNext = last;
@@ -56,6 +59,7 @@ struct wren_buffer : wrei_object
 
     VkBuffer buffer;
     VmaAllocation vma_allocation;
+    usz size;
     VkDeviceAddress device_address;
     void* host_address;
 
@@ -70,27 +74,120 @@ struct wren_buffer : wrei_object
 
 wrei_ref<wren_buffer> wren_buffer_create(wren_context*, usz size);
 
+struct wren_staging_allocation
+{
+    VkBuffer buffer;
+    usz offset;
+    void* host_address;
+};
+
+// Valid for commands recorded into the current frame, see wren_commands
+wren_staging_allocation wren_staging_allocate(wren_context*, usz size);
+
+// Client memory imported through VK_EXT_external_memory_host, usable as a transfer source.
+// The host allocation must outlive the buffer, including any deferred destruction
+struct wren_host_buffer : wrei_object
+{
+    wren_context* ctx;
+
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+    usz size;
+
+    ~wren_host_buffer();
+};
+
+// Returns null if host memory import is unsupported, or data is not suitably aligned
+wrei_ref<wren_host_buffer> wren_host_buffer_import(wren_context*, void* data, usz size);
+
 u32 wren_find_vk_memory_type_index(wren_context* vk, u32 type_filter, VkMemoryPropertyFlags properties);
 
+// Maximum number of images that can be registered in the bindless image array
+static constexpr u32 wren_max_image_descriptors = 16384;
+
+// Multi-planar images each hold a combined image sampler set, which may use one descriptor per plane. Sets
+// come from pools of a fixed size, and another pool is created whenever every existing one is full
+static constexpr u32 wren_ycbcr_images_per_pool = 64;
+static constexpr u32 wren_max_ycbcr_descriptors_per_image = 3;
+
+struct wren_ycbcr_conversion;
+
 struct wren_image : wrei_object
 {
     wren_context* ctx;
 
     VkImage image;
     VkImageView view;
-    VkDeviceMemory memory;
     VmaAllocation vma_allocation;
+
+    // Memory imported for the image, with one allocation per plane for disjoint imports
+    std::vector<VkDeviceMemory> memory;
+
     VkExtent3D extent;
+    VkFormat format;
+    VkImageUsageFlags usage;
+
+    // Size of the underlying image, which may be rounded up from extent. Only the extent is ever written
+    VkExtent3D image_extent;
+
+    // Index into the bindless sampled image array
+    u32 descriptor = ~0u;
+
+    // Multi-planar images can't be sampled through the bindless array, and are bound individually instead
+    wren_ycbcr_conversion* ycbcr = nullptr;
+    VkDescriptorSet ycbcr_set = nullptr;
+    VkDescriptorPool ycbcr_pool = nullptr;
+
+    // Still in VK_IMAGE_LAYOUT_UNDEFINED, and must be transitioned to GENERAL before it is first sampled
+    bool layout_pending = false;
 
     ~wren_image();
 };
 
-wrei_ref<wren_image> wren_image_create(wren_context*, VkExtent2D extent, VkFormat format);
+wrei_ref<wren_image> wren_image_create(wren_context*, VkExtent2D extent, VkFormat format, VkImageUsageFlags extra_usage = 0);
 void wren_image_update(wren_image*, const void* data);
 
+// Uploads only the given rectangles from data, whose rows are stride bytes apart.
+// Anything outside the rectangles is preserved, which requires the image to have been fully written before.
+// With a converter, data holds pixels of the converter's source format, which are converted while staging
+void wren_image_update_rects(wren_image*, const void* data, usz stride, std::span<const VkRect2D> rects, const wrei_pixel_converter* converter = nullptr);
+
+// As wren_image_update_rects, but copies directly from a buffer without staging.
+// The buffer holds source rows starting from first_row, at offset
+void wren_image_copy_rects(wren_image*, VkBuffer buffer, usz offset, usz stride, std::span<const VkRect2D> rects, u32 first_row = 0);
+
+// Whether images of this format may be created with VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT
+bool wren_image_host_copy_supported(wren_context*, VkFormat);
+
+// As wren_image_update_rects, but writes from the host immediately without recording any commands.
+// Requires HOST_TRANSFER usage, and the image must not be accessed by any pending device work
+void wren_image_host_copy_rects(wren_image*, const void* data, usz stride, std::span<const VkRect2D> rects);
+
+void wren_image_allocate_descriptor(wren_image*);
+
 VkSampler wren_sampler_create(wren_context*);
 void wren_sampler_destroy(wren_context*, VkSampler);
 
+// -----------------------------------------------------------------------------
+
+// All pipelines share the context pipeline layout, which binds the bindless image
+// array at set 0 and exposes a block of push constants to all stages
+static constexpr u32 wren_push_constant_size = 128;
+
+struct wren_pipeline_info
+{
+    std::span<const u32> vertex_spirv;
+    std::span<const u32> fragment_spirv;
+    VkFormat format;
+    bool blend;
+
+    // Defaults to the context's pipeline layout
+    VkPipelineLayout layout = nullptr;
+};
+
+VkPipeline wren_pipeline_create(wren_context*, const wren_pipeline_info&);
+void wren_pipeline_destroy(wren_context*, VkPipeline);
+
 void wren_transition(wren_context* vk, VkCommandBuffer cmd, VkImage image,
         VkPipelineStageFlags2 src, VkPipelineStageFlags2 dst,
         VkAccessFlags2 src_access, VkAccessFlags2 dst_access,
@@ -101,14 +198,42 @@ struct wren_format
     u32 drm;
     VkFormat vk;
     VkFormat vk_srgb;
+
+    // Bytes per texel
+    u32 texel_size;
+
+    // Format has no alpha channel, contents must be treated as fully opaque
+    bool opaque;
+
 	bool is_ycbcr;
 };
 
 std::span<const wren_format> wren_get_formats();
 std::optional<wren_format> wren_find_format_from_vulkan(VkFormat);
 std::optional<wren_format> wren_find_format_from_drm(u32 drm_format);
+
+// Whether images of this format can be sampled with linear filtering and written by transfers
+bool wren_format_is_sampleable(wren_context*, VkFormat);
 void wren_enumerate_drm_modifiers(wren_context*, const wren_format&, std::vector<VkDrmFormatModifierProperties2EXT>&);
 
+// Whether dmabufs of this format and modifier can be imported as sampled images
+bool wren_drm_modifier_is_importable(wren_context*, const wren_format&, u64 modifier, bool disjoint = false);
+
+// Sampler conversion for a multi-planar format. Sampling requires a combined image sampler with the
+// conversion's immutable sampler, so each conversion has its own set layout and pipeline layout.
+// The pipeline layout extends the context's with a second set, and is compatible with it for set 0
+struct wren_ycbcr_conversion
+{
+    VkFormat format;
+    VkSamplerYcbcrConversion conversion;
+    VkSampler sampler;
+    VkDescriptorSetLayout set_layout;
+    VkPipelineLayout pipeline_layout;
+};
+
+// Created on first use, returns null if the format can't be converted
+wren_ycbcr_conversion* wren_get_ycbcr_conversion(wren_context*, VkFormat);
+
 // -----------------------------------------------------------------------------
 
 constexpr static u32 wren_dma_max_planes = 4;
@@ -130,4 +255,61 @@ struct wren_dma_params
     zwp_linux_buffer_params_v1_flags flags;
 };
 
+// Returns null if the import fails. Never waits on the device.
+// Imports of a dmabuf that is already cached return the existing image
 wrei_ref<wren_image> wren_image_import_dmabuf(wren_context*, const wren_dma_params& params);
+
+// Called once for every image returned by wren_image_import_dmabuf, when the buffer wrapping it is
+// destroyed. Cached imports that nothing uses expire after wren_dmabuf_cache_expiry submissions
+void wren_dmabuf_cache_release(wren_context*, wren_image*);
+void wren_dmabuf_cache_expire(wren_context*);
+
+// Identifies an imported dmabuf by the files behind its planes and its layout, so that
+// new wl_buffers wrapping the same memory can reuse the import
+
+struct wren_dmabuf_key
+{
+    struct plane
+    {
+        u64 dev;
+        u64 ino;
+        u64 offset;
+        u64 stride;
+    };
+
+    std::array<plane, wren_dma_max_planes> planes;
+    u64 plane_count;
+    u64 modifier;
+    u64 format;
+    u64 extent;
+
+    bool operator==(const wren_dmabuf_key&) const = default;
+};
+
+struct wren_dmabuf_key_hash
+{
+    using is_avalanching = void;
+
+    u64 operator()(const wren_dmabuf_key& key) const noexcept
+    {
+        static_assert(std::has_unique_object_representations_v<wren_dmabuf_key>);
+        return ankerl::unordered_dense::hash<std::string_view>{}(std::string_view(reinterpret_cast<const char*>(&key), sizeof(key)));
+    }
+};
+
+struct wren_dmabuf_cache_entry
+{
+    wrei_ref<wren_image> image;
+
+    // Bytes referenced by the planes
+    usz size;
+
+    // Value of the cache's use counter at the last import that returned this entry
+    u64 last_use;
+
+    // Imports returned for this entry that have not been released yet
+    u32 users;
+
+    // Wren timeline value at which the last user was released
+    u64 released_value;
+};
@@ -3,6 +3,78 @@
 
 #include "wroc/server.hpp"
 
+static
+void wren_init_descriptors(wren_context* ctx)
+{
+    ctx->sampler = wren_sampler_create(ctx);
+
+    std::array bindings {
+        VkDescriptorSetLayoutBinding {
+            .binding = 0,
+            .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+            .descriptorCount = wren_max_image_descriptors,
+            .stageFlags = VK_SHADER_STAGE_ALL,
+        },
+        VkDescriptorSetLayoutBinding {
+            .binding = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_ALL,
+            .pImmutableSamplers = &ctx->sampler,
+        },
+    };
+
+    std::array<VkDescriptorBindingFlags, bindings.size()> binding_flags {
+        VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT
+            | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT
+            | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT,
+        0,
+    };
+
+    wren_check(ctx->vk.CreateDescriptorSetLayout(ctx->device, wrei_ptr_to(VkDescriptorSetLayoutCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .pNext = wrei_ptr_to(VkDescriptorSetLayoutBindingFlagsCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+            .bindingCount = u32(binding_flags.size()),
+            .pBindingFlags = binding_flags.data(),
+        }),
+        .flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+        .bindingCount = u32(bindings.size()),
+        .pBindings = bindings.data(),
+    }), nullptr, &ctx->set_layout));
+
+    std::array pool_sizes {
+        VkDescriptorPoolSize { VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, wren_max_image_descriptors },
+        VkDescriptorPoolSize { VK_DESCRIPTOR_TYPE_SAMPLER,       1 },
+    };
+
+    wren_check(ctx->vk.CreateDescriptorPool(ctx->device, wrei_ptr_to(VkDescriptorPoolCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT,
+        .maxSets = 1,
+        .poolSizeCount = u32(pool_sizes.size()),
+        .pPoolSizes = pool_sizes.data(),
+    }), nullptr, &ctx->descriptor_pool));
+
+    wren_check(ctx->vk.AllocateDescriptorSets(ctx->device, wrei_ptr_to(VkDescriptorSetAllocateInfo {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = ctx->descriptor_pool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &ctx->set_layout,
+    }), &ctx->set));
+
+    wren_check(ctx->vk.CreatePipelineLayout(ctx->device, wrei_ptr_to(VkPipelineLayoutCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &ctx->set_layout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = wrei_ptr_to(VkPushConstantRange {
+            .stageFlags = VK_SHADER_STAGE_ALL,
+            .size = wren_push_constant_size,
+        }),
+    }), nullptr, &ctx->pipeline_layout));
+}
+
 wrei_ref<wren_context> wren_create()
 {
     auto ctx = wrei_adopt_ref(new wren_context {});
@@ -64,6 +136,9 @@ wrei_ref<wren_context> wren_create()
         VkPhysicalDeviceProperties2 props { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
         ctx->vk.GetPhysicalDeviceProperties2(ctx->physical_device, &props);
         log_info("  Selected: {}", props.properties.deviceName);
+
+        ctx->timestamp_period = props.properties.limits.timestampPeriod;
+        ctx->device_type = props.properties.deviceType;
     }
 
     ctx->queue_family = ~0u;
@@ -76,7 +151,59 @@ wrei_ref<wren_context> wren_create()
         }
     }
 
-    std::array device_extensions {
+    // Prefer a transfer only family, falling back to a second queue in the graphics family.
+    // Uploads copy arbitrary rectangles, so only families without a transfer granularity restriction are usable
+
+    ctx->transfer_queue_family = ctx->queue_family;
+    u32 transfer_queue_index = 0;
+    for (u32 i = 0; i < queue_props.size(); ++i) {
+        auto& props = queue_props[i];
+        if (!(props.queueFlags & VK_QUEUE_TRANSFER_BIT)) continue;
+        if (props.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) continue;
+        auto granularity = props.minImageTransferGranularity;
+        if (granularity.width != 1 || granularity.height != 1 || granularity.depth != 1) continue;
+
+        ctx->transfer_queue_family = i;
+        break;
+    }
+    if (ctx->transfer_queue_family == ctx->queue_family && queue_props[ctx->queue_family].queueCount > 1) {
+        transfer_queue_index = 1;
+    }
+    ctx->queue_families = { ctx->queue_family, ctx->transfer_queue_family };
+
+    if (ctx->transfer_queue_family != ctx->queue_family) {
+        log_info("  Transfer queue: family {}", ctx->transfer_queue_family);
+    } else if (transfer_queue_index) {
+        log_info("  Transfer queue: graphics family, queue {}", transfer_queue_index);
+    } else {
+        log_info("  Transfer queue: shared with graphics");
+    }
+
+    std::array queue_priorities { 1.f, 1.f };
+    std::vector<VkDeviceQueueCreateInfo> queue_infos {
+        VkDeviceQueueCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .queueFamilyIndex = ctx->queue_family,
+            .queueCount = 1 + transfer_queue_index,
+            .pQueuePriorities = queue_priorities.data(),
+        },
+    };
+    if (ctx->transfer_queue_family != ctx->queue_family) {
+        queue_infos.emplace_back(VkDeviceQueueCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .queueFamilyIndex = ctx->transfer_queue_family,
+            .queueCount = 1,
+            .pQueuePriorities = queue_priorities.data(),
+        });
+    }
+
+    std::vector<VkExtensionProperties> available_extensions;
+    wren_vk_enumerate(available_extensions, ctx->vk.EnumerateDeviceExtensionProperties, ctx->physical_device, nullptr);
+    auto is_extension_available = [&](const char* name) {
+        return std::ranges::any_of(available_extensions, [&](auto& e) { return std::strcmp(e.extensionName, name) == 0; });
+    };
+
+    std::vector device_extensions {
         VK_KHR_SWAPCHAIN_EXTENSION_NAME,
         VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME,
         VK_EXT_SWAPCHAIN_MAINTENANCE_1_EXTENSION_NAME,
@@ -86,6 +213,90 @@ wrei_ref<wren_context> wren_create()
         VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME,
     };
 
+    if (is_extension_available(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME)) {
+        VkPhysicalDeviceExternalMemoryHostPropertiesEXT host_props {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT,
+        };
+        ctx->vk.GetPhysicalDeviceProperties2(ctx->physical_device, wrei_ptr_to(VkPhysicalDeviceProperties2 {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+            .pNext = &host_props,
+        }));
+
+        device_extensions.emplace_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+        ctx->host_memory_import = true;
+        ctx->host_pointer_alignment = host_props.minImportedHostPointerAlignment;
+        log_info("  Host memory import supported (alignment = {})", ctx->host_pointer_alignment);
+    }
+
+    VkPhysicalDeviceHostImageCopyFeaturesEXT host_image_copy_features {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_IMAGE_COPY_FEATURES_EXT,
+    };
+    if (is_extension_available(VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME)) {
+        ctx->vk.GetPhysicalDeviceFeatures2(ctx->physical_device, wrei_ptr_to(VkPhysicalDeviceFeatures2 {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+            .pNext = &host_image_copy_features,
+        }));
+
+        // Sampled images are kept in GENERAL, so host copies must be able to write to it directly
+
+        std::vector<VkImageLayout> dst_layouts;
+        wren_vk_enumerate(dst_layouts, [&](u32* count, VkImageLayout* layouts) {
+            VkPhysicalDeviceHostImageCopyPropertiesEXT host_copy_props {
+                .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_IMAGE_COPY_PROPERTIES_EXT,
+                .copyDstLayoutCount = *count,
+                .pCopyDstLayouts = layouts,
+            };
+            ctx->vk.GetPhysicalDeviceProperties2(ctx->physical_device, wrei_ptr_to(VkPhysicalDeviceProperties2 {
+                .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+                .pNext = &host_copy_props,
+            }));
+            *count = host_copy_props.copyDstLayoutCount;
+        });
+
+        if (host_image_copy_features.hostImageCopy && std::ranges::contains(dst_layouts, VK_IMAGE_LAYOUT_GENERAL)) {
+            device_extensions.emplace_back(VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME);
+            ctx->host_image_copy = true;
+            log_info("  Host image copy supported");
+        }
+    }
+
+    {
+        VkPhysicalDeviceVulkan11Features features11 {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES,
+        };
+        ctx->vk.GetPhysicalDeviceFeatures2(ctx->physical_device, wrei_ptr_to(VkPhysicalDeviceFeatures2 {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+            .pNext = &features11,
+        }));
+
+        ctx->ycbcr_conversion = features11.samplerYcbcrConversion;
+        if (ctx->ycbcr_conversion) {
+            log_info("  YCbCr sampler conversion supported");
+        }
+    }
+
+    if (is_extension_available(VK_EXT_PHYSICAL_DEVICE_DRM_EXTENSION_NAME)) {
+        VkPhysicalDeviceDrmPropertiesEXT drm_props {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DRM_PROPERTIES_EXT,
+        };
+        ctx->vk.GetPhysicalDeviceProperties2(ctx->physical_device, wrei_ptr_to(VkPhysicalDeviceProperties2 {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+            .pNext = &drm_props,
+        }));
+
+        if (drm_props.hasRender) {
+            ctx->has_drm_device = true;
+            ctx->drm_device = makedev(drm_props.renderMajor, drm_props.renderMinor);
+        } else if (drm_props.hasPrimary) {
+            ctx->has_drm_device = true;
+            ctx->drm_device = makedev(drm_props.primaryMajor, drm_props.primaryMinor);
+        }
+
+        if (ctx->has_drm_device) {
+            log_info("  DRM device: {}:{}", major(ctx->drm_device), minor(ctx->drm_device));
+        }
+    }
+
     wren_check(ctx->vk.CreateDevice(ctx->physical_device, wrei_ptr_to(VkDeviceCreateInfo {
         .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
         .pNext = wren_vk_make_chain_in({
@@ -99,6 +310,7 @@ wrei_ref<wren_context> wren_create()
             wrei_ptr_to(VkPhysicalDeviceVulkan11Features {
                 .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES,
                 .storagePushConstant16 = true,
+                .samplerYcbcrConversion = ctx->ycbcr_conversion,
                 .shaderDrawParameters = true,
             }),
             wrei_ptr_to(VkPhysicalDeviceVulkan12Features {
@@ -128,14 +340,9 @@ wrei_ref<wren_context> wren_create()
                 .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SWAPCHAIN_MAINTENANCE_1_FEATURES_EXT,
                 .swapchainMaintenance1 = true,
             }),
-        }),
-        .queueCreateInfoCount = 1,
-        .pQueueCreateInfos = wrei_ptr_to(VkDeviceQueueCreateInfo {
-            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-            .queueFamilyIndex = ctx->queue_family,
-            .queueCount = 1,
-            .pQueuePriorities = wrei_ptr_to(1.f),
-        }),
+        }, ctx->host_image_copy ? &host_image_copy_features : nullptr),
+        .queueCreateInfoCount = u32(queue_infos.size()),
+        .pQueueCreateInfos = queue_infos.data(),
         .enabledExtensionCount = u32(device_extensions.size()),
         .ppEnabledExtensionNames = device_extensions.data(),
     }), nullptr, &ctx->device));
@@ -143,6 +350,7 @@ wrei_ref<wren_context> wren_create()
     wren_load_device_functions(ctx.get());
 
     ctx->vk.GetDeviceQueue(ctx->device, ctx->queue_family, 0, &ctx->queue);
+    ctx->vk.GetDeviceQueue(ctx->device, ctx->transfer_queue_family, transfer_queue_index, &ctx->transfer_queue);
 
     wren_check(vkwsi_context_create(&ctx->vkwsi, wrei_ptr_to(vkwsi_context_info{
         .instance = ctx->instance,
@@ -173,11 +381,21 @@ wrei_ref<wren_context> wren_create()
         .vulkanApiVersion = VK_API_VERSION_1_3,
     }), &ctx->vma));
 
-    wren_check(ctx->vk.CreateCommandPool(ctx->device, wrei_ptr_to(VkCommandPoolCreateInfo {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-        .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
-        .queueFamilyIndex = ctx->queue_family,
-    }), nullptr, &ctx->cmd_pool));
+    ctx->frames.resize(wren_frames_in_flight);
+    for (auto& frame : ctx->frames) {
+        wren_frame_create(ctx.get(), frame);
+    }
+
+    wren_check(ctx->vk.CreateSemaphore(ctx->device, wrei_ptr_to(VkSemaphoreCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = wrei_ptr_to(VkSemaphoreTypeCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+            .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+            .initialValue = 0,
+        }),
+    }), nullptr, &ctx->timeline));
+
+    wren_init_descriptors(ctx.get());
 
     return ctx;
 }
@@ -13,6 +13,10 @@ struct wroc_wayland_output : wroc_output
 
     wl_callback* frame_callback = {};
 
+    // Created on the render thread, completed on the main thread
+    std::mutex presentation_mutex;
+    std::vector<wp_presentation_feedback*> presentation_feedbacks;
+
     ~wroc_wayland_output();
 };
 
@@ -42,6 +46,7 @@ struct wroc_backend
     struct wl_compositor* wl_compositor;
     struct xdg_wm_base* xdg_wm_base = {};
     struct zxdg_decoration_manager_v1* decoration_manager = {};
+    struct wp_presentation* presentation = {};
 
     struct wl_seat* seat = {};
 
@@ -63,3 +68,5 @@ extern const wl_seat_listener wroc_wl_seat_listener;
 extern const wl_registry_listener wroc_wl_registry_listener;
 extern const zxdg_toplevel_decoration_v1_listener wroc_zxdg_toplevel_decoration_v1_listener;
 extern const xdg_toplevel_listener wroc_xdg_toplevel_listener;
+extern const wp_presentation_listener wroc_wp_presentation_listener;
+extern const wp_presentation_feedback_listener wroc_wp_presentation_feedback_listener;
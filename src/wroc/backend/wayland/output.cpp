@@ -42,14 +42,89 @@ void wroc_listen_wl_callback_done(void* data, struct wl_callback*, u32 time)
     //     wl_pointer_set_cursor(pointer->wl_pointer, pointer->last_serial, nullptr, 0, 0);
     // }
 
+    wl_callback_destroy(output->frame_callback);
+    output->frame_callback = nullptr;
+
+    // Not re-armed here, the compositor requests another frame when something changes
+
     wroc_post_event(output->server, wroc_output_event {
         { .type = wroc_event_type::output_frame },
         .output = output,
     });
+}
 
-    wl_callback_destroy(output->frame_callback);
+void wroc_backend_output_request_frame(wroc_output* base)
+{
+    auto* output = static_cast<wroc_wayland_output*>(base);
+    if (output->frame_callback) return;
 
     wroc_register_frame_callback(output);
+
+    // May be requested outside of backend event dispatch
+    wl_display_flush(output->server->backend->wl_display);
+}
+
+// -----------------------------------------------------------------------------
+
+static
+void wroc_listen_presentation_feedback_sync_output(void*, wp_presentation_feedback*, wl_output*)
+{
+}
+
+static
+void wroc_listen_presentation_feedback_presented(void* data, wp_presentation_feedback* feedback,
+    u32 tv_sec_hi, u32 tv_sec_lo, u32 tv_nsec, u32 refresh, u32 seq_hi, u32 seq_lo, u32 flags)
+{
+    auto* output = static_cast<wroc_wayland_output*>(data);
+
+    {
+        std::scoped_lock lock{output->presentation_mutex};
+        std::erase(output->presentation_feedbacks, feedback);
+    }
+    wp_presentation_feedback_destroy(feedback);
+
+    auto seconds = std::chrono::seconds(u64(tv_sec_hi) << 32 | tv_sec_lo);
+    auto presentation = std::chrono::steady_clock::time_point(seconds + std::chrono::nanoseconds(tv_nsec));
+
+    wroc_output_presented(output, presentation, std::chrono::nanoseconds(refresh));
+}
+
+static
+void wroc_listen_presentation_feedback_discarded(void* data, wp_presentation_feedback* feedback)
+{
+    auto* output = static_cast<wroc_wayland_output*>(data);
+
+    {
+        std::scoped_lock lock{output->presentation_mutex};
+        std::erase(output->presentation_feedbacks, feedback);
+    }
+    wp_presentation_feedback_destroy(feedback);
+
+    wroc_output_discarded(output);
+}
+
+const wp_presentation_feedback_listener wroc_wp_presentation_feedback_listener {
+    .sync_output = wroc_listen_presentation_feedback_sync_output,
+    .presented   = wroc_listen_presentation_feedback_presented,
+    .discarded   = wroc_listen_presentation_feedback_discarded,
+};
+
+bool wroc_backend_output_supports_presentation_feedback(wroc_output* base)
+{
+    return base->server->backend->presentation;
+}
+
+void wroc_backend_output_request_presentation_feedback(wroc_output* base)
+{
+    auto* output = static_cast<wroc_wayland_output*>(base);
+
+    // Events are only sent after the commit that follows, so the listener is in place before any arrive
+
+    auto* feedback = wp_presentation_feedback(output->server->backend->presentation, output->wl_surface);
+    wp_presentation_feedback_add_listener(feedback, &wroc_wp_presentation_feedback_listener, output);
+
+    std::scoped_lock lock{output->presentation_mutex};
+    output->presentation_feedbacks.emplace_back(feedback);
 }
 
 // -----------------------------------------------------------------------------
@@ -223,6 +298,8 @@ void wroc_backend_output_create(wroc_backend* backend)
 
 wroc_wayland_output::~wroc_wayland_output()
 {
+    std::erase(server->outputs, this);
+
     if (vk_surface) server->renderer->wren->vk.DestroySurfaceKHR(server->renderer->wren->instance, vk_surface, nullptr);
 
     if (decoration)  zxdg_toplevel_decoration_v1_destroy(decoration);
@@ -231,6 +308,10 @@ wroc_wayland_output::~wroc_wayland_output()
     if (wl_surface)  wl_surface_destroy(wl_surface);
 
     if (frame_callback) wl_callback_destroy(frame_callback);
+
+    for (auto* feedback : presentation_feedbacks) {
+        wp_presentation_feedback_destroy(feedback);
+    }
 }
 
 void wroc_backend_output_destroy(wroc_output* output)
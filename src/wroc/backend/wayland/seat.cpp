@@ -7,7 +7,7 @@
 // -----------------------------------------------------------------------------
 
 static
-void wroc_backend_pointer_absolute(wroc_wayland_pointer* pointer, wl_fixed_t sx, wl_fixed_t sy)
+void wroc_backend_pointer_absolute(wroc_wayland_pointer* pointer, wl_fixed_t sx, wl_fixed_t sy, u32 time)
 {
     wrei_vec2f64 pos = {wl_fixed_to_double(sx), wl_fixed_to_double(sy)};
     pointer->layout_position = pos + pointer->current_output->position;
@@ -15,6 +15,7 @@ void wroc_backend_pointer_absolute(wroc_wayland_pointer* pointer, wl_fixed_t sx,
         { .type = wroc_event_type::pointer_motion },
         .pointer = pointer,
         .output = pointer->current_output,
+        .motion { .time = time },
     });
 }
 
@@ -27,7 +28,7 @@ void wroc_listen_wl_pointer_enter(void* data, wl_pointer*, u32 serial, wl_surfac
     pointer->last_serial = serial;
     pointer->current_output = wroc_backend_find_output_for_surface(pointer->server->backend, surface);
 
-    wroc_backend_pointer_absolute(pointer, sx, sy);
+    wroc_backend_pointer_absolute(pointer, sx, sy, 0);
 }
 
 static
@@ -40,11 +41,11 @@ void wroc_listen_wl_pointer_leave(void* data, wl_pointer*, u32 serial, wl_surfac
 }
 
 static
-void wroc_listen_wl_pointer_motion(void* data, wl_pointer*, u32 /* time */, wl_fixed_t sx, wl_fixed_t sy)
+void wroc_listen_wl_pointer_motion(void* data, wl_pointer*, u32 time, wl_fixed_t sx, wl_fixed_t sy)
 {
     auto* pointer = static_cast<wroc_wayland_pointer*>(data);
 
-    wroc_backend_pointer_absolute(pointer, sx, sy);
+    wroc_backend_pointer_absolute(pointer, sx, sy, time);
 }
 
 static
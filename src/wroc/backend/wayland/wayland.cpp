@@ -16,6 +16,23 @@ const xdg_wm_base_listener wroc_xdg_wm_base_listener = {
 
 // -----------------------------------------------------------------------------
 
+static
+void wroc_listen_wp_presentation_clock_id(void*, wp_presentation*, u32 clk_id)
+{
+    log_debug("wp_presentation::clock_id(clk_id = {})", clk_id);
+
+    // Presentation timestamps are compared against std::chrono::steady_clock
+    if (clk_id != CLOCK_MONOTONIC) {
+        log_warn("Host presentation clock is not CLOCK_MONOTONIC, frame scheduling will be inaccurate");
+    }
+}
+
+const wp_presentation_listener wroc_wp_presentation_listener = {
+    .clock_id = wroc_listen_wp_presentation_clock_id,
+};
+
+// -----------------------------------------------------------------------------
+
 static
 void wroc_listen_registry_global(void *data, wl_registry*, u32 name, const char* interface, u32 version)
 {
@@ -39,6 +56,9 @@ void wroc_listen_registry_global(void *data, wl_registry*, u32 name, const char*
             xdg_wm_base_add_listener(backend->xdg_wm_base, &wroc_xdg_wm_base_listener, backend);
         })
         IF_BIND_INTERFACE(zxdg_decoration_manager_v1_interface, decoration_manager)
+        IF_BIND_INTERFACE(wp_presentation_interface, presentation, {
+            wp_presentation_add_listener(backend->presentation, &wroc_wp_presentation_listener, backend);
+        })
         IF_BIND_INTERFACE(wl_seat_interface, seat, {
             wl_seat_add_listener(backend->seat, &wroc_wl_seat_listener, backend);
         })
@@ -117,6 +137,7 @@ void wroc_backend_destroy(wroc_backend* backend)
     backend->outputs.clear();
 
     zxdg_decoration_manager_v1_destroy(backend->decoration_manager);
+    if (backend->presentation) wp_presentation_destroy(backend->presentation);
     wl_compositor_destroy(backend->wl_compositor);
     xdg_wm_base_destroy(backend->xdg_wm_base);
     wl_seat_destroy(backend->seat);
@@ -1,5 +1,7 @@
 #include "server.hpp"
 
+#include "wren/wren.hpp"
+
 const struct wl_buffer_interface wroc_wl_buffer_impl = {
     .destroy = wroc_simple_resource_destroy_callback,
 };
@@ -13,8 +15,31 @@ void wroc_wl_buffer::lock()
 void wroc_wl_buffer::unlock()
 {
     if (locked) {
-        // log_warn("RELEASING BUFFER {}", (void*)this);
-        if (wl_buffer) wl_buffer_send_release(wl_buffer);
+        if (reading || last_use > wroc_renderer_get_completed_value(server->renderer.get())) {
+            // log_warn("DEFERRING BUFFER RELEASE {}", (void*)this);
+            server->renderer->pending_release.emplace_back(this);
+        } else {
+            // log_warn("RELEASING BUFFER {}", (void*)this);
+            if (wl_buffer) wl_buffer_send_release(wl_buffer);
+        }
     }
     locked = false;
 }
+
+void wroc_wl_buffer_release_completed(wroc_server* server)
+{
+    auto* renderer = server->renderer.get();
+    if (renderer->pending_release.empty()) return;
+
+    u64 completed = wroc_renderer_get_completed_value(renderer);
+
+    std::erase_if(renderer->pending_release, [&](const wrei_ref<wroc_wl_buffer>& buffer) {
+        if (buffer->locked) {
+            // Client committed the buffer again before it was released, the next unlock takes over
+            return true;
+        }
+        if (buffer->reading || buffer->last_use > completed) return false;
+        if (buffer->wl_buffer) wl_buffer_send_release(buffer->wl_buffer);
+        return true;
+    });
+}
@@ -1,5 +1,7 @@
 #include "server.hpp"
 
+#include "wrei/shm.hpp"
+
 static
 void wroc_dmabuf_create_params(wl_client* client, wl_resource* resource, u32 params_id)
 {
@@ -17,19 +19,89 @@ wroc_zwp_linux_buffer_params::~wroc_zwp_linux_buffer_params()
     }
 }
 
+static
+void wroc_dmabuf_send_feedback(wroc_server* server, wl_resource* resource, bool scanout)
+{
+    auto& formats = server->dmabuf_formats;
+    auto* wren = server->renderer->wren.get();
+
+    auto with_array = [](std::span<const std::byte> data, auto&& fn) {
+        wl_array array;
+        wl_array_init(&array);
+        std::memcpy(wl_array_add(&array, data.size()), data.data(), data.size());
+        fn(&array);
+        wl_array_release(&array);
+    };
+
+    auto device = std::as_bytes(std::span(&wren->drm_device, 1));
+
+    zwp_linux_dmabuf_feedback_v1_send_format_table(resource, formats.table_fd, formats.table.size() * sizeof(wroc_dmabuf_format_table_entry));
+    with_array(device, [&](wl_array* array) { zwp_linux_dmabuf_feedback_v1_send_main_device(resource, array); });
+
+    auto send_tranche = [&](std::span<const u16> indices, u32 flags) {
+        with_array(device, [&](wl_array* array) { zwp_linux_dmabuf_feedback_v1_send_tranche_target_device(resource, array); });
+        with_array(std::as_bytes(indices), [&](wl_array* array) { zwp_linux_dmabuf_feedback_v1_send_tranche_formats(resource, array); });
+        zwp_linux_dmabuf_feedback_v1_send_tranche_flags(resource, flags);
+        zwp_linux_dmabuf_feedback_v1_send_tranche_done(resource);
+    };
+
+    // Tranches are sent in order of preference
+
+    if (scanout && !formats.tranche_scanout.empty()) {
+        send_tranche(formats.tranche_scanout, ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT);
+    }
+    send_tranche(formats.tranche_all, 0);
+
+    zwp_linux_dmabuf_feedback_v1_send_done(resource);
+}
+
 static
 void wroc_dmabuf_get_default_feedback(wl_client* client, wl_resource* resource, u32 id)
 {
     auto* new_resource = wl_resource_create(client, &zwp_linux_dmabuf_feedback_v1_interface, wl_resource_get_version(resource), id);
     wroc_resource_set_implementation(new_resource, &wroc_zwp_linux_dmabuf_feedback_v1_impl, nullptr);
+
+    wroc_dmabuf_send_feedback(wroc_get_userdata<wroc_server>(resource), new_resource, false);
+}
+
+// Fullscreen requests aren't implemented yet, so any surface covering a whole output is treated as fullscreen
+static
+bool wroc_dmabuf_surface_is_fullscreen(wroc_surface* surface)
+{
+    auto* xdg_surface = wroc_xdg_surface::try_from(surface);
+    if (!xdg_surface) return false;
+
+    auto rect = wroc_xdg_surface_get_layout_rect(xdg_surface);
+    return std::ranges::any_of(surface->server->outputs, [&](wroc_output* output) {
+        wrei_vec2i32 origin(output->position);
+        return rect.contains(origin) && rect.contains(origin + output->size);
+    });
+}
+
+void wroc_dmabuf_update_surface_feedback(wroc_surface* surface)
+{
+    bool scanout = wroc_dmabuf_surface_is_fullscreen(surface);
+    if (scanout == surface->dmabuf_feedback_scanout) return;
+    surface->dmabuf_feedback_scanout = scanout;
+
+    for (auto* resource : surface->dmabuf_feedbacks) {
+        wroc_dmabuf_send_feedback(surface->server, resource, scanout);
+    }
 }
 
 static
-void wroc_dmabuf_get_surface_feedback(wl_client* client, wl_resource* resource, u32 id, wl_resource* surface)
+void wroc_dmabuf_get_surface_feedback(wl_client* client, wl_resource* resource, u32 id, wl_resource* wl_surface)
 {
     auto* new_resource = wl_resource_create(client, &zwp_linux_dmabuf_feedback_v1_interface, wl_resource_get_version(resource), id);
     wroc_resource_set_implementation(new_resource, &wroc_zwp_linux_dmabuf_feedback_v1_impl, nullptr);
 
+    auto* surface = wroc_get_userdata<wroc_surface>(wl_surface);
+
+    // Bring existing feedback up to date first, so that every object for the surface has seen the same tranches
+
+    wroc_dmabuf_update_surface_feedback(surface);
+    surface->dmabuf_feedbacks.emplace_back(new_resource);
+    wroc_dmabuf_send_feedback(surface->server, new_resource, surface->dmabuf_feedback_scanout);
 }
 
 const struct zwp_linux_dmabuf_v1_interface wroc_zwp_linux_dmabuf_v1_impl = {
@@ -45,9 +117,19 @@ void wroc_dmabuf_params_add(wl_client* client, wl_resource* resource, int fd, u3
     // TODO: We should enforce a limit on the number of open files a client can have to keep under 1024 for the whole process
 
     auto* params = wroc_get_userdata<wroc_zwp_linux_buffer_params>(resource);
-    if (!params->params.planes.empty()) {
-        log_error("Multiple plane formats not currently supported");
+
+    if (plane_idx >= wren_dma_max_planes) {
+        close(fd);
+        wl_resource_post_error(resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_IDX, "plane index out of bounds");
+        return;
+    }
+
+    if (std::ranges::any_of(params->params.planes, [&](auto& plane) { return plane.plane_idx == plane_idx; })) {
+        close(fd);
+        wl_resource_post_error(resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_SET, "plane already set");
+        return;
     }
+
     params->params.planes.emplace_back(wren_dma_plane{
         .fd = fd,
         .plane_idx = plane_idx,
@@ -57,10 +139,77 @@ void wroc_dmabuf_params_add(wl_client* client, wl_resource* resource, int fd, u3
     });
 }
 
+// Posts a protocol error and returns false if the params can't be used to create a buffer
+static
+bool wroc_dmabuf_params_validate(wl_resource* params_resource, i32 width, i32 height, u32 format)
+{
+    auto* params = wroc_get_userdata<wroc_zwp_linux_buffer_params>(params_resource);
+
+    if (params->used) {
+        wl_resource_post_error(params_resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_ALREADY_USED, "params already used");
+        return false;
+    }
+    params->used = true;
+
+    if (params->params.planes.empty()) {
+        wl_resource_post_error(params_resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INCOMPLETE, "no planes added");
+        return false;
+    }
+
+    // Planes may be added in any order, but must not leave gaps
+
+    auto& planes = params->params.planes;
+    std::ranges::sort(planes, {}, &wren_dma_plane::plane_idx);
+    for (u32 i = 0; i < planes.size(); ++i) {
+        if (planes[i].plane_idx != i) {
+            wl_resource_post_error(params_resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INCOMPLETE, "missing plane %u", i);
+            return false;
+        }
+        if (planes[i].drm_modifier != planes[0].drm_modifier) {
+            wl_resource_post_error(params_resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_FORMAT, "planes have different modifiers");
+            return false;
+        }
+    }
+
+    if (width <= 0 || height <= 0) {
+        wl_resource_post_error(params_resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_DIMENSIONS, "invalid width or height");
+        return false;
+    }
+
+    // Only advertised combinations are accepted, Vulkan requires the plane count to match the modifier
+
+    auto& table = params->server->dmabuf_formats.table;
+    auto entry = std::ranges::find_if(table, [&](auto& e) { return e.format == format && e.modifier == planes.front().drm_modifier; });
+    if (entry == table.end()) {
+        wl_resource_post_error(params_resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_FORMAT, "unsupported format or modifier");
+        return false;
+    }
+
+    u32 plane_count = params->server->dmabuf_formats.plane_counts[entry - table.begin()];
+    if (planes.size() != plane_count) {
+        wl_resource_post_error(params_resource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INCOMPLETE, "expected %u planes", plane_count);
+        return false;
+    }
+
+    return true;
+}
+
+// Imports the planes and creates the wl_buffer, returns null if the import fails
 static
 wroc_dma_buffer* wroc_dmabuf_create_buffer(wl_client* client, wl_resource* params_resource, u32 buffer_id, i32 width, i32 height, u32 format, u32 flags)
 {
     auto* params = wroc_get_userdata<wroc_zwp_linux_buffer_params>(params_resource);
+
+    params->params.format = *wren_find_format_from_drm(format);
+    params->params.extent = { u32(width), u32(height) };
+    params->params.flags = zwp_linux_buffer_params_v1_flags(flags);
+
+    auto image = wren_image_import_dmabuf(params->server->renderer->wren.get(), params->params);
+    if (!image) {
+        log_error("Failed to import dmabuf ({}, {})", width, height);
+        return nullptr;
+    }
+
     auto* new_resource = wl_resource_create(client, &wl_buffer_interface, 1, buffer_id);
     auto* buffer = new wroc_dma_buffer {};
     buffer->server = params->server;
@@ -69,13 +218,22 @@ wroc_dma_buffer* wroc_dmabuf_create_buffer(wl_client* client, wl_resource* param
 
     wroc_resource_set_implementation_refcounted(new_resource, &wroc_wl_buffer_impl, buffer);
 
+    buffer->extent = {width, height};
+    buffer->opaque = params->params.format.opaque;
+    buffer->image = std::move(image);
 
-    params->params.format = wren_find_format_from_drm(format).value();
-    params->params.extent = { u32(width), u32(height) };
-    params->params.flags = zwp_linux_buffer_params_v1_flags(flags);
+    // Planes sharing a file share its fences, so only keep one fd for each
 
-    buffer->extent = {width, height};
-    buffer->image = wren_image_import_dmabuf(buffer->server->renderer->wren.get(), params->params);
+    std::vector<std::pair<dev_t, ino_t>> files;
+    for (auto& plane : params->params.planes) {
+        struct stat st;
+        if (fstat(plane.fd, &st) == 0) {
+            if (std::ranges::contains(files, std::pair(st.st_dev, st.st_ino))) continue;
+            files.emplace_back(st.st_dev, st.st_ino);
+        }
+        int fd = fcntl(plane.fd, F_DUPFD_CLOEXEC, 0);
+        if (fd >= 0) buffer->fence_fds.emplace_back(fd);
+    }
 
     return buffer;
 }
@@ -83,6 +241,8 @@ wroc_dma_buffer* wroc_dmabuf_create_buffer(wl_client* client, wl_resource* param
 static
 void wroc_dmabuf_params_create_buffer(wl_client* client, wl_resource* params, i32 width, i32 height, u32 format, u32 flags)
 {
+    if (!wroc_dmabuf_params_validate(params, width, height, format)) return;
+
     auto buffer = wroc_dmabuf_create_buffer(client, params, 0, width, height, format, flags);
     if (buffer) {
         zwp_linux_buffer_params_v1_send_created(params, buffer->wl_buffer);
@@ -92,8 +252,15 @@ void wroc_dmabuf_params_create_buffer(wl_client* client, wl_resource* params, i3
 }
 
 static
-void wroc_dmabuf_params_create_buffer_immed(wl_client* client, wl_resource* params, u32 buffer_id, i32 width, i32 height, u32 format, u32 flags) {
-    wroc_dmabuf_create_buffer(client, params, buffer_id, width, height, format, flags);
+void wroc_dmabuf_params_create_buffer_immed(wl_client* client, wl_resource* params, u32 buffer_id, i32 width, i32 height, u32 format, u32 flags)
+{
+    if (!wroc_dmabuf_params_validate(params, width, height, format)) return;
+
+    // The client is already using the buffer, so there is no way to report a failed import other than an error
+
+    if (!wroc_dmabuf_create_buffer(client, params, buffer_id, width, height, format, flags)) {
+        wl_resource_post_error(params, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_WL_BUFFER, "dmabuf import failed");
+    }
 }
 
 const struct zwp_linux_buffer_params_v1_interface wroc_zwp_linux_buffer_params_v1_impl = {
@@ -107,9 +274,141 @@ const struct zwp_linux_dmabuf_feedback_v1_interface wroc_zwp_linux_dmabuf_feedba
     .destroy = wroc_simple_resource_destroy_callback,
 };
 
-void wroc_dma_buffer::on_commit()
+wroc_dma_buffer::~wroc_dma_buffer()
+{
+    for (int fd : fence_fds) {
+        close(fd);
+    }
+
+    if (image) {
+        wren_dmabuf_cache_release(image->ctx, image.get());
+    }
+}
+
+// Returns a sync_file that signals once all pending writes to the dmabuf have completed, or -1 if the
+// exporter doesn't track implicit fences, in which case the buffer is treated as ready
+static
+int wroc_dmabuf_export_write_fence(int dmabuf_fd)
+{
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+    dma_buf_export_sync_file request {
+        .flags = DMA_BUF_SYNC_READ,
+        .fd = -1,
+    };
+    int res;
+    do {
+        res = ioctl(dmabuf_fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &request);
+    } while (res < 0 && (errno == EINTR || errno == EAGAIN));
+    return res < 0 ? -1 : request.fd;
+#else
+    return -1;
+#endif
+}
+
+static
+bool wroc_sync_file_is_signalled(int fd)
+{
+    pollfd pfd { .fd = fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+wroc_fenced_buffer::~wroc_fenced_buffer()
+{
+    for (auto& fence : fences) {
+        wl_event_source_remove(fence.source);
+        close(fence.fd);
+    }
+}
+
+void wroc_surface_drop_fenced_buffers(wroc_surface* surface, usz count)
+{
+    if (!count) return;
+
+    for (auto& fenced : std::span(surface->fenced_buffers).first(count)) {
+        if (fenced->buffer.get() != surface->current.buffer.get()) {
+            fenced->buffer->unlock();
+        }
+        surface->current.frame_callbacks.take_and_append_all(std::move(fenced->frame_callbacks));
+    }
+    surface->fenced_buffers.erase(surface->fenced_buffers.begin(), surface->fenced_buffers.begin() + count);
+
+    if (surface->current.frame_callbacks.front()) {
+        wroc_request_frame(surface->server);
+    }
+}
+
+static
+int wroc_surface_handle_buffer_fence(int fd, u32, void* data)
+{
+    auto* fenced = static_cast<wroc_fenced_buffer*>(data);
+    auto* surface = fenced->surface;
+
+    std::erase_if(fenced->fences, [&](const wroc_buffer_fence& fence) {
+        if (fence.fd != fd) return false;
+        wl_event_source_remove(fence.source);
+        close(fence.fd);
+        return true;
+    });
+
+    if (!fenced->fences.empty()) return 0;
+
+    // The newest ready buffer is displayed, and every buffer committed before it is replaced unseen
+
+    auto index = std::ranges::find_if(surface->fenced_buffers, [&](const auto& f) { return f.get() == fenced; }) - surface->fenced_buffers.begin();
+    wroc_surface_drop_fenced_buffers(surface, index);
+
+    wrei_ref<wroc_wl_buffer> buffer = fenced->buffer;
+    surface->current.frame_callbacks.take_and_append_all(std::move(fenced->frame_callbacks));
+    surface->fenced_buffers.erase(surface->fenced_buffers.begin());
+
+    wroc_surface_finish_upload(surface, buffer.get());
+
+    // Damage is reapplied again when a buffer committed after this one is displayed
+    if (!surface->fenced_buffers.empty()) {
+        surface->upload_deferred = true;
+    }
+
+    wroc_request_frame(surface->server);
+
+    return 0;
+}
+
+void wroc_dma_buffer::on_commit(wroc_surface* surface)
 {
     lock();
+
+    // Sampling a buffer that the client is still rendering to would stall the queue for every surface
+    // behind it, so the buffer is only displayed once its write fences signal. Until then the previous
+    // buffer stays on screen, and the commit's damage is reapplied when this one replaces it
+
+    auto fenced = std::make_unique<wroc_fenced_buffer>();
+    fenced->surface = surface;
+    fenced->buffer = this;
+
+    for (int dmabuf_fd : fence_fds) {
+        int fd = wroc_dmabuf_export_write_fence(dmabuf_fd);
+        if (fd < 0) continue;
+
+        if (wroc_sync_file_is_signalled(fd)) {
+            close(fd);
+            continue;
+        }
+
+        // Without a way to wait on the fence, the buffer is treated as ready
+        auto* source = wl_event_loop_add_fd(server->event_loop, fd, WL_EVENT_READABLE, wroc_surface_handle_buffer_fence, fenced.get());
+        if (!source) {
+            log_error("Failed to wait on dmabuf fence");
+            close(fd);
+            continue;
+        }
+
+        fenced->fences.emplace_back(fd, source);
+    }
+
+    if (!fenced->fences.empty()) {
+        surface->fenced_buffers.emplace_back(std::move(fenced));
+        surface->upload_deferred = true;
+    }
 }
 
 void wroc_zwp_linux_dmabuf_v1_bind_global(wl_client* client, void* data, u32 version, u32 id)
@@ -117,16 +416,75 @@ void wroc_zwp_linux_dmabuf_v1_bind_global(wl_client* client, void* data, u32 ver
     auto* new_resource = wl_resource_create(client, &zwp_linux_dmabuf_v1_interface, version, id);
     wroc_resource_set_implementation(new_resource, &wroc_zwp_linux_dmabuf_v1_impl, static_cast<wroc_server*>(data));
 
-    auto send_modifier = [&](u32 format, u64 modifier) {
-        zwp_linux_dmabuf_v1_send_modifier(new_resource, format, modifier >> 32, modifier & 0xFFFF'FFFF);
-    };
+    // Version 4 clients receive formats through feedback objects instead
 
-    for (auto& format : {
-        DRM_FORMAT_XRGB8888,
-        DRM_FORMAT_ARGB8888,
-    }) {
-        zwp_linux_dmabuf_v1_send_format(new_resource, format);
-        // send_modifier(format, DRM_FORMAT_MOD_INVALID);
-        send_modifier(format, DRM_FORMAT_MOD_LINEAR);
+    if (version >= 4) return;
+
+    auto* server = static_cast<wroc_server*>(data);
+    u32 last_format = DRM_FORMAT_INVALID;
+    for (auto& entry : server->dmabuf_formats.table) {
+        if (entry.format != last_format) {
+            zwp_linux_dmabuf_v1_send_format(new_resource, entry.format);
+            last_format = entry.format;
+        }
+        if (version >= ZWP_LINUX_DMABUF_V1_MODIFIER_SINCE_VERSION) {
+            zwp_linux_dmabuf_v1_send_modifier(new_resource, entry.format, entry.modifier >> 32, entry.modifier & 0xFFFF'FFFF);
+        }
     }
-};
+}
+
+wroc_dmabuf_formats::~wroc_dmabuf_formats()
+{
+    if (table_fd >= 0) close(table_fd);
+}
+
+void wroc_dmabuf_init_formats(wroc_server* server)
+{
+    auto* wren = server->renderer->wren.get();
+    auto& formats = server->dmabuf_formats;
+
+    std::vector<VkDrmFormatModifierProperties2EXT> modifiers;
+    for (auto& format : wren_get_formats()) {
+        // Multi-planar formats are converted with chroma samples at the midpoint. Only imports with planes in
+        // separate dmabufs need DISJOINT, which is checked when they are made
+        VkFormatFeatureFlags2 required = VK_FORMAT_FEATURE_2_SAMPLED_IMAGE_BIT;
+        if (format.is_ycbcr) {
+            required |= VK_FORMAT_FEATURE_2_MIDPOINT_CHROMA_SAMPLES_BIT;
+        }
+
+        wren_enumerate_drm_modifiers(wren, format, modifiers);
+        for (auto& modifier : modifiers) {
+            if ((modifier.drmFormatModifierTilingFeatures & required) != required) continue;
+            if (modifier.drmFormatModifierPlaneCount > wren_dma_max_planes) continue;
+            if (!wren_drm_modifier_is_importable(wren, format, modifier.drmFormatModifier)) continue;
+
+            // Tranches index the table with 16 bits
+            if (formats.table.size() > UINT16_MAX) break;
+
+            u16 index = u16(formats.table.size());
+            formats.table.emplace_back(format.drm, 0u, modifier.drmFormatModifier);
+            formats.plane_counts.emplace_back(modifier.drmFormatModifierPlaneCount);
+            formats.tranche_all.emplace_back(index);
+
+            // The output is presented through a swapchain rather than scanning out client buffers directly, so the
+            // best a fullscreen surface can do is avoid modifiers that carry auxiliary compression planes, which
+            // other compositors and display engines are least likely to be able to scan out
+
+            if (modifier.drmFormatModifierPlaneCount == 1) {
+                formats.tranche_scanout.emplace_back(index);
+            }
+        }
+    }
+
+    log_info("Dmabuf formats: {} format/modifier pairs, {} preferred for scanout", formats.table.size(), formats.tranche_scanout.size());
+
+    if (!wren->has_drm_device) {
+        log_warn("Vulkan device has no DRM node, dmabuf feedback unavailable");
+        return;
+    }
+
+    formats.table_fd = wrei_create_sealed_file("dmabuf-format-table", std::as_bytes(std::span(formats.table)));
+    if (formats.table_fd < 0) {
+        log_error("Failed to create dmabuf format table, dmabuf feedback unavailable");
+    }
+}
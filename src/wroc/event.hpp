@@ -57,6 +57,8 @@ struct wroc_pointer_event : wroc_event
         } button;
         struct {
             wrei_vec2f64 delta;
+            // Host timestamp in milliseconds with an undefined base, 0 if unknown
+            u32 time;
         } motion;
         struct {
             wrei_vec2f64 delta;
@@ -67,6 +69,7 @@ struct wroc_pointer_event : wroc_event
 void wroc_post_event(wroc_server*, const wroc_event& event);
 
 bool wroc_handle_movesize_interaction(wroc_server*, const wroc_event& event);
+void wroc_latch_movesize_interaction(wroc_server*, wroc_output*);
 
 void wroc_handle_output_event(  wroc_server*, const wroc_output_event&);
 void wroc_handle_keyboard_event(wroc_server*, const wroc_keyboard_event&);
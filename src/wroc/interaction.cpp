@@ -1,5 +1,44 @@
 #include "event.hpp"
 
+// Moves are latched while building a frame for `building`, which already covers the damage
+static
+void wroc_movesize_move_to(wroc_server* server, wroc_xdg_toplevel* toplevel, wrei_vec2f64 pointer_position, wroc_output* building = nullptr)
+{
+    auto& movesize = server->movesize;
+    auto old_rect = wroc_xdg_surface_get_layout_rect(toplevel->base.get());
+    toplevel->base->position = movesize.surface_grab + (pointer_position - movesize.pointer_grab);
+    auto new_rect = wroc_xdg_surface_get_layout_rect(toplevel->base.get());
+    if (new_rect.origin != old_rect.origin) {
+        wroc_damage_layout(server, old_rect, building);
+        wroc_damage_layout(server, new_rect, building);
+
+        // Moving onto or off an output may change whether the surface counts as fullscreen
+        wroc_dmabuf_update_surface_feedback(toplevel->base->surface.get());
+    }
+}
+
+void wroc_latch_movesize_interaction(wroc_server* server, wroc_output* output)
+{
+    if (server->interaction_mode != wroc_interaction_mode::move) return;
+
+    auto* toplevel = server->movesize.grabbed_toplevel.get();
+    auto* pointer = server->seat->pointer;
+    if (!toplevel || !pointer) return;
+
+    // Take the newest pointer sample, optionally extrapolated towards the predicted presentation
+
+    auto position = pointer->layout_position;
+    if (server->pointer_prediction > 0ns) {
+        auto target = wroc_output_predict_presentation(output, std::chrono::steady_clock::now());
+        auto horizon = std::min<std::chrono::nanoseconds>(target - pointer->last_motion, server->pointer_prediction);
+        if (horizon > 0ns) {
+            position += pointer->velocity * std::chrono::duration<f64>(horizon).count();
+        }
+    }
+
+    wroc_movesize_move_to(server, toplevel, position, output);
+}
+
 bool wroc_handle_movesize_interaction(wroc_server* server, const wroc_event& base_event)
 {
     if (base_event.type == wroc_event_type::pointer_button) {
@@ -23,6 +62,11 @@ bool wroc_handle_movesize_interaction(wroc_server* server, const wroc_event& bas
             }
         } else if (server->interaction_mode == wroc_interaction_mode::move
                 || server->interaction_mode == wroc_interaction_mode::size) {
+            // Settle on the real pointer position, discarding any prediction
+            if (auto* toplevel = server->movesize.grabbed_toplevel.get();
+                    toplevel && server->interaction_mode == wroc_interaction_mode::move) {
+                wroc_movesize_move_to(server, toplevel, event.pointer->layout_position);
+            }
             server->interaction_mode = wroc_interaction_mode::normal;
         }
     }
@@ -34,7 +78,8 @@ bool wroc_handle_movesize_interaction(wroc_server* server, const wroc_event& bas
         auto& movesize = server->movesize;
         if (auto* toplevel = movesize.grabbed_toplevel.get()) {
             if (server->interaction_mode == wroc_interaction_mode::move) {
-                toplevel->base->position = movesize.surface_grab + (event.pointer->layout_position - movesize.pointer_grab);
+                // Applied in wroc_latch_movesize_interaction right before the next frame is recorded
+                wroc_request_frame(server);
             } else if (server->interaction_mode == wroc_interaction_mode::size) {
                 auto new_size = glm::max(movesize.surface_grab + (event.pointer->layout_position - movesize.pointer_grab), wrei_vec2f64{});
                 wroc_xdg_toplevel_set_size(toplevel, new_size);
@@ -40,22 +40,83 @@ void wroc_output_init_swapchain(wroc_output* output)
     sw_info.format = output->format.format;
     sw_info.color_space = output->format.colorSpace;
     vkwsi_swapchain_set_info(output->swapchain, &sw_info);
+
+    // Start and end timestamps for each frame in flight
+
+    wren_check(wren->vk.CreateQueryPool(wren->device, wrei_ptr_to(VkQueryPoolCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = wroc_output_frames_in_flight * 2,
+    }), nullptr, &output->timestamp_queries));
+
+    // Command buffers recorded by the render thread
+
+    for (auto& frame : output->frames) {
+        wren_check(wren->vk.CreateCommandPool(wren->device, wrei_ptr_to(VkCommandPoolCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+            .queueFamilyIndex = wren->queue_family,
+        }), nullptr, &frame.pool));
+
+        wren_check(wren->vk.AllocateCommandBuffers(wren->device, wrei_ptr_to(VkCommandBufferAllocateInfo {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = frame.pool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
+        }), &frame.cmd));
+    }
 }
 
+static
+int wroc_output_render_timer(void* data);
+
 static
 void wroc_output_added(wroc_output* output)
 {
     log_debug("Output added");
 
+    if (std::ranges::find(output->server->outputs, output) == output->server->outputs.end()) {
+        output->server->outputs.emplace_back(output);
+    }
+
     if (!output->swapchain) {
         wroc_output_init_swapchain(output);
     }
+
+    if (!output->scheduler.timer) {
+        output->scheduler.timer = wl_event_loop_add_timer(output->server->event_loop, wroc_output_render_timer, output);
+    }
+
+    output->damage.add({{}, output->size});
+    wroc_output_request_frame(output);
 }
 
 static
 void wroc_output_removed(wroc_output* output)
 {
     log_debug("Output removed");
+    std::erase(output->server->outputs, output);
+
+    if (output->scheduler.timer) {
+        wl_event_source_remove(output->scheduler.timer);
+        output->scheduler.timer = nullptr;
+    }
+
+    // Frames may still be queued on the render thread or in flight on the GPU
+    auto* wren = output->server->renderer->wren.get();
+    wroc_renderer_flush(output->server->renderer.get());
+    wren_wait_idle(wren);
+
+    for (auto& frame : output->frames) {
+        if (frame.pool) wren->vk.DestroyCommandPool(wren->device, frame.pool, nullptr);
+    }
+    output->frames = {};
+
+    if (output->timestamp_queries) {
+        wren->vk.DestroyQueryPool(wren->device, output->timestamp_queries, nullptr);
+        output->timestamp_queries = nullptr;
+    }
+
     if (output->timeline) {
         output->server->renderer->wren->vk.DestroySemaphore(output->server->renderer->wren->device, output->timeline, nullptr);
     }
@@ -64,12 +125,131 @@ void wroc_output_removed(wroc_output* output)
     }
 }
 
+std::chrono::steady_clock::time_point wroc_output_predict_presentation(wroc_output* output, std::chrono::steady_clock::time_point now)
+{
+    auto& scheduler = output->scheduler;
+    if (scheduler.refresh <= 0ns || scheduler.last_presentation == std::chrono::steady_clock::time_point{}) {
+        return now;
+    }
+
+    auto intervals = (now - scheduler.last_presentation) / scheduler.refresh + 1;
+    return scheduler.last_presentation + intervals * scheduler.refresh;
+}
+
+static
+void wroc_output_render_now(wroc_output* output)
+{
+    output->scheduler.render_scheduled = false;
+    output->frame_requested = false;
+
+    wroc_render_frame(output);
+}
+
+static
+int wroc_output_render_timer(void* data)
+{
+    wroc_output_render_now(static_cast<wroc_output*>(data));
+    return 0;
+}
+
+static
+void wroc_output_frame(wroc_output* output)
+{
+    // Nothing changed since the last frame, stay idle until the next request
+
+    if (!output->frame_requested || output->scheduler.render_scheduled) return;
+
+    // Wait for the render thread to return the previous frame, see wroc_renderer_retire_completed
+    if (output->render_pending) return;
+
+    // Delay composition until just before the predicted presentation, so that commits arriving
+    // in the meantime still make this frame. Timers have millisecond precision, rounding the
+    // delay down errs on the side of rendering early
+
+    auto now = std::chrono::steady_clock::now();
+    auto predicted_render_time = std::ranges::max(output->scheduler.render_times);
+    auto start = wroc_output_predict_presentation(output, now) - predicted_render_time - output->server->render_safety_margin;
+    auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(start - now);
+
+    if (delay >= 1ms && output->scheduler.timer) {
+        output->scheduler.render_scheduled = true;
+        wl_event_source_timer_update(output->scheduler.timer, i32(delay.count()));
+        return;
+    }
+
+    wroc_output_render_now(output);
+}
+
+void wroc_output_add_render_time(wroc_output* output, std::chrono::nanoseconds render_time)
+{
+    auto& scheduler = output->scheduler;
+    scheduler.render_times[scheduler.render_time_index] = render_time;
+    scheduler.render_time_index = (scheduler.render_time_index + 1) % wroc_output_render_time_samples;
+}
+
+void wroc_output_presented(wroc_output* output, std::chrono::steady_clock::time_point presentation, std::chrono::nanoseconds refresh)
+{
+    auto& scheduler = output->scheduler;
+
+    scheduler.last_presentation = presentation;
+    scheduler.refresh = refresh;
+    scheduler.frames_presented++;
+
+    if (!scheduler.pending_targets.empty()) {
+        auto target = scheduler.pending_targets.front();
+        scheduler.pending_targets.erase(scheduler.pending_targets.begin());
+
+        // Presented at least one refresh later than intended
+        if (refresh > 0ns && presentation > target + refresh / 2) {
+            scheduler.deadlines_missed++;
+        }
+    }
+
+    if (scheduler.frames_presented % wroc_output_stats_interval == 0) {
+        log_info("Output frame stats: presented = {}, discarded = {}, missed deadlines = {} ({:.2f}%), predicted render time = {}",
+            scheduler.frames_presented, scheduler.frames_discarded, scheduler.deadlines_missed,
+            100.0 * scheduler.deadlines_missed / scheduler.frames_presented,
+            wrei_duration_to_string(std::ranges::max(scheduler.render_times)));
+    }
+}
+
+void wroc_output_discarded(wroc_output* output)
+{
+    auto& scheduler = output->scheduler;
+
+    scheduler.frames_discarded++;
+
+    if (!scheduler.pending_targets.empty()) {
+        scheduler.pending_targets.erase(scheduler.pending_targets.begin());
+    }
+}
+
+void wroc_output_request_frame(wroc_output* output)
+{
+    output->frame_requested = true;
+
+    // Anything requested before a scheduled render is latched by it
+    if (output->scheduler.render_scheduled) return;
+
+    // The render thread drives the host surface until the pending job returns, which re-arms the request
+    if (output->render_pending) return;
+
+    wroc_backend_output_request_frame(output);
+}
+
+void wroc_request_frame(wroc_server* server)
+{
+    for (auto* output : server->outputs) {
+        wroc_output_request_frame(output);
+    }
+}
+
 void wroc_handle_output_event(wroc_server* server, const wroc_output_event& event)
 {
     switch (event.type) {
         case wroc_event_type::output_added:   wroc_output_added(  event.output); break;
         case wroc_event_type::output_removed: wroc_output_removed(event.output); break;
-        case wroc_event_type::output_frame:   wroc_render_frame(  event.output); break;
+        case wroc_event_type::output_frame:   wroc_output_frame(  event.output); break;
         default: {}
     }
 }
@@ -84,15 +264,81 @@ VkSemaphoreSubmitInfo wroc_output_get_next_submit_info(wroc_output* output)
     };
 }
 
-vkwsi_swapchain_image wroc_output_acquire_image(wroc_output* output)
+vkwsi_swapchain_image wroc_output_acquire_image(wroc_output* output, wrei_vec2i32 size)
 {
-
     auto* wren = output->server->renderer->wren.get();
-    vkwsi_swapchain_resize(output->swapchain, {u32(output->size.x), u32(output->size.y)});
+    vkwsi_swapchain_resize(output->swapchain, {u32(size.x), u32(size.y)});
+
+    // Rendering waits for the acquire on the GPU, see wroc_render_output
 
     auto timeline_info = wroc_output_get_next_submit_info(output);
-    wren_check(vkwsi_swapchain_acquire(&output->swapchain, 1, wren->queue, &timeline_info, 1));
-    wren_wait_for_timeline_value(wren, timeline_info);
+    std::scoped_lock queue_lock{wren->queue_mutex};
+    if (wren_check(vkwsi_swapchain_acquire(&output->swapchain, 1, wren->queue, &timeline_info, 1),
+            VK_SUBOPTIMAL_KHR, VK_ERROR_OUT_OF_DATE_KHR) != VK_SUCCESS) {
+        output->swapchain_invalidated = true;
+    }
 
     return vkwsi_swapchain_get_current(output->swapchain);
 }
+
+wrei_region wroc_output_take_repaint_region(wroc_output* output, const vkwsi_swapchain_image& image, wrei_region damage, u32* p_age)
+{
+    wrei_vec2i32 extent = {image.extent.width, image.extent.height};
+    wrei_rect<i32> bounds = {{}, extent};
+
+    // Images from a previous swapchain can't be repaired, and their handles may be reused by the new one
+
+    if (extent != output->frame_extent || std::exchange(output->swapchain_invalidated, false)) {
+        output->frame_extent = extent;
+        output->image_frames.clear();
+        for (auto& history : output->damage_history) {
+            history.clear();
+        }
+    }
+
+    // Buffer age is the number of frames since this image was last rendered to, or 0 if unknown
+
+    auto frame = ++output->frame_count;
+
+    u32 age = 0;
+    auto image_frame = std::ranges::find(output->image_frames, image.image, &std::pair<VkImage, u64>::first);
+    if (image_frame != output->image_frames.end()) {
+        age = u32(frame - image_frame->second);
+        image_frame->second = frame;
+    } else {
+        output->image_frames.emplace_back(image.image, frame);
+    }
+
+    std::ranges::move_backward(output->damage_history.begin(), output->damage_history.end() - 1, output->damage_history.end());
+    output->damage_history.front() = std::move(damage);
+    output->damage_history.front().intersect(bounds);
+
+    wrei_region repaint;
+    if (age == 0 || age > output->damage_history.size()) {
+        repaint.add(bounds);
+    } else {
+        for (u32 i = 0; i < age; ++i) {
+            repaint.add(output->damage_history[i]);
+        }
+    }
+
+    *p_age = age;
+    return repaint;
+}
+
+void wroc_damage_layout(wroc_server* server, const wrei_region& region, wroc_output* building)
+{
+    for (auto* output : server->outputs) {
+        wrei_region local = region;
+        local.translate(-wrei_vec2i32(output->position));
+        local.intersect({{}, output->size});
+        if (local.empty()) continue;
+        output->damage.add(local);
+        if (output != building) wroc_output_request_frame(output);
+    }
+}
+
+void wroc_damage_layout(wroc_server* server, wrei_rect<i32> rect, wroc_output* building)
+{
+    wroc_damage_layout(server, wrei_region(rect), building);
+}
@@ -37,6 +37,30 @@ void wroc_pointer_button(wroc_pointer* pointer, u32 button, bool pressed)
     }
 }
 
+static
+void wroc_pointer_track_motion(wroc_pointer* pointer, u32 time)
+{
+    // Host timestamps give the spacing between samples independent of when they were dispatched
+
+    pointer->last_motion = std::chrono::steady_clock::now();
+
+    bool timed = time && pointer->last_motion_time;
+    auto dt = std::chrono::milliseconds(i32(time - pointer->last_motion_time));
+
+    // Samples within the same millisecond are folded into the next one
+    if (timed && dt == 0ms) return;
+
+    if (timed && dt > 0ms && dt <= wroc_pointer_velocity_timeout) {
+        auto velocity = (pointer->layout_position - pointer->last_motion_position) / std::chrono::duration<f64>(dt).count();
+        pointer->velocity = glm::mix(pointer->velocity, velocity, 0.5);
+    } else {
+        pointer->velocity = {};
+    }
+
+    pointer->last_motion_position = pointer->layout_position;
+    pointer->last_motion_time = time;
+}
+
 static
 void wroc_pointer_motion(wroc_pointer* pointer, wroc_output* output, wrei_vec2f64 delta)
 {
@@ -45,6 +69,10 @@ void wroc_pointer_motion(wroc_pointer* pointer, wroc_output* output, wrei_vec2f6
     auto pos = pointer->layout_position;
 
     auto* server = pointer->server;
+
+    // Hit test now, as frames are no longer rendered while the output is idle
+    wroc_update_toplevel_under_cursor(server);
+
     auto* under_cursor = server->toplevel_under_cursor.get();
     auto* surface_under_cursor = under_cursor ? under_cursor->base->surface.get() : nullptr;
     if (surface_under_cursor != pointer->focused_surface.get()) {
@@ -118,6 +146,7 @@ void wroc_handle_pointer_event(wroc_server* server, const wroc_pointer_event& ev
             wroc_pointer_button(event.pointer, event.button.button, event.button.pressed);
             break;
         case wroc_event_type::pointer_motion:
+            wroc_pointer_track_motion(event.pointer, event.motion.time);
             wroc_pointer_motion(event.pointer, event.output, event.motion.delta);
             break;
         case wroc_event_type::pointer_axis:
@@ -6,6 +6,19 @@
 
 #include "wroc/event.hpp"
 
+#include <wroc_compositor_vert.h>
+#include <wroc_compositor_frag.h>
+#include <wroc_compositor_ycbcr_frag.h>
+
+static
+void wroc_render_thread(std::stop_token, wroc_renderer*);
+
+static
+void wroc_renderer_completion_thread(std::stop_token, wroc_renderer*);
+
+static
+int wroc_renderer_handle_completion(int fd, u32 mask, void* data);
+
 void wroc_renderer_create(wroc_server* server)
 {
     auto* renderer = (server->renderer = wrei_adopt_ref(new wroc_renderer {})).get();
@@ -24,135 +37,797 @@ void wroc_renderer_create(wroc_server* server)
 
     renderer->image = wren_image_create(renderer->wren.get(), { u32(w), u32(h) }, VK_FORMAT_R8G8B8A8_UNORM);
     wren_image_update(renderer->image.get(), data);
+
+    auto* wren = renderer->wren.get();
+    wren_check(wren->vk.CreateSemaphore(wren->device, wrei_ptr_to(VkSemaphoreCreateInfo {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = wrei_ptr_to(VkSemaphoreTypeCreateInfo {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+            .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+            .initialValue = 0,
+        }),
+    }), nullptr, &renderer->timeline));
+
+    renderer->completion_fd = wrei_unix_check_n1(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    renderer->completion_source = wl_event_loop_add_fd(server->event_loop, renderer->completion_fd, WL_EVENT_READABLE,
+        wroc_renderer_handle_completion, renderer);
+
+    // Leave room for the event loop and render thread
+    renderer->copy_pool = wrei_task_pool_create(2);
+    renderer->copy_completion_fd = wrei_unix_check_n1(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    renderer->copy_completion_source = wl_event_loop_add_fd(server->event_loop, renderer->copy_completion_fd, WL_EVENT_READABLE,
+        wroc_shm_handle_copy_completion, renderer);
+
+    renderer->thread = std::jthread(wroc_render_thread, renderer);
+    renderer->completion_thread = std::jthread(wroc_renderer_completion_thread, renderer);
 }
 
 wroc_renderer::~wroc_renderer()
 {
+    thread.request_stop();
+    if (thread.joinable()) thread.join();
+    completion_thread.request_stop();
+    if (completion_thread.joinable()) completion_thread.join();
+
+    wrei_task_pool_wait_idle(copy_pool.get());
+    copies.clear();
+    copy_pool.reset();
+    wl_event_source_remove(copy_completion_source);
+    close(copy_completion_fd);
+
+    wren_wait_idle(wren.get());
+    queue.clear();
+    completed.clear();
+    retired.clear();
+    pending_release.clear();
+
+    wl_event_source_remove(completion_source);
+    close(completion_fd);
+    wren->vk.DestroySemaphore(wren->device, timeline, nullptr);
+
+    for (auto& p : pipelines) {
+        wren_pipeline_destroy(wren.get(), p.opaque);
+        wren_pipeline_destroy(wren.get(), p.blend);
+    }
+    for (auto& p : ycbcr_pipelines) {
+        wren_pipeline_destroy(wren.get(), p.pipeline);
+    }
     image.reset();
     vkwsi_context_destroy(wren->vkwsi);
     wren.reset();
 }
 
-void wroc_render_frame(wroc_output* output)
+// -----------------------------------------------------------------------------
+
+// Must match the layouts in shaders/compositor.glsl
+
+static constexpr u32 wroc_instance_opaque = 1 << 0;
+
+struct wroc_shader_instance
+{
+    wrei_vec4f32 dst;
+    wrei_vec4f32 src;
+    u32 image;
+    u32 flags;
+};
+
+struct wroc_shader_push_constants
 {
-    auto* wren = output->server->renderer->wren.get();
-    auto cmd = wren_begin_commands(wren);
+    VkDeviceAddress instances;
+    wrei_vec2f32 output_size;
+};
 
-    auto current = wroc_output_acquire_image(output);
+static
+const wroc_render_pipelines& wroc_renderer_get_pipelines(wroc_renderer* renderer, VkFormat format)
+{
+    for (auto& p : renderer->pipelines) {
+        if (p.format == format) return p;
+    }
+
+    auto create = [&](bool blend) {
+        return wren_pipeline_create(renderer->wren.get(), {
+            .vertex_spirv = wroc_compositor_vert,
+            .fragment_spirv = wroc_compositor_frag,
+            .format = format,
+            .blend = blend,
+        });
+    };
+
+    return renderer->pipelines.emplace_back(wroc_render_pipelines {
+        .format = format,
+        .opaque = create(false),
+        .blend = create(true),
+    });
+}
+
+static
+VkPipeline wroc_renderer_get_ycbcr_pipeline(wroc_renderer* renderer, VkFormat format, const wren_ycbcr_conversion* conversion)
+{
+    for (auto& p : renderer->ycbcr_pipelines) {
+        if (p.format == format && p.conversion == conversion) return p.pipeline;
+    }
+
+    return renderer->ycbcr_pipelines.emplace_back(wroc_render_ycbcr_pipeline {
+        .format = format,
+        .conversion = conversion,
+        .pipeline = wren_pipeline_create(renderer->wren.get(), {
+            .vertex_spirv = wroc_compositor_vert,
+            .fragment_spirv = wroc_compositor_ycbcr_frag,
+            .format = format,
+            .blend = false,
+            .layout = conversion->pipeline_layout,
+        }),
+    }).pipeline;
+}
+
+static
+wroc_shader_instance* wroc_renderer_reserve_instances(wroc_renderer* renderer, wroc_render_job& job, wroc_output_frame& frame, usz count)
+{
+    usz size = count * sizeof(wroc_shader_instance);
+    if (!frame.instances || frame.instances->size < size) {
+        job.replaced_instances = std::move(frame.instances);
+        frame.instances = wren_buffer_create(renderer->wren.get(), std::bit_ceil(std::max(size, 64 * sizeof(wroc_shader_instance))));
+    }
+
+    return frame.instances->host<wroc_shader_instance>();
+}
+
+// Runs on the render thread
+
+static
+void wroc_render_output(wroc_renderer* renderer, wroc_render_job& job)
+{
+    auto* output = job.output;
+    auto* wren = renderer->wren.get();
+
+    // Wait for the frame that last used this slot, bounding the number of frames in flight
+
+    u32 frame_index = output->frame_index;
+    auto& frame = output->frames[frame_index];
+    output->frame_index = (output->frame_index + 1) % wroc_output_frames_in_flight;
+
+    if (frame.timeline_value) {
+        wren_wait_for_timeline_value(wren, {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = renderer->timeline,
+            .value = frame.timeline_value,
+        });
+    }
+
+    // The previous frame in this slot has completed, report its duration back to the scheduler
+
+    u32 first_query = frame_index * 2;
+    if (frame.timestamps_written) {
+        frame.timestamps_written = false;
+
+        std::array<u64, 2> timestamps;
+        if (wren_check(wren->vk.GetQueryPoolResults(wren->device, output->timestamp_queries, first_query, 2,
+                sizeof(timestamps), timestamps.data(), sizeof(u64), VK_QUERY_RESULT_64_BIT), VK_NOT_READY) == VK_SUCCESS) {
+            auto gpu_time = std::chrono::nanoseconds(i64(f64(timestamps[1] - timestamps[0]) * wren->timestamp_period));
+            job.render_time = frame.cpu_time + gpu_time;
+        }
+    }
+
+    auto cpu_start = std::chrono::steady_clock::now();
+
+    wren_check(wren->vk.ResetCommandPool(wren->device, frame.pool, 0));
+    auto cmd = frame.cmd;
+    wren_check(wren->vk.BeginCommandBuffer(cmd, wrei_ptr_to(VkCommandBufferBeginInfo {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    })));
+
+    auto current = wroc_output_acquire_image(output, job.size);
+
+    u32 age;
+    auto repaint = wroc_output_take_repaint_region(output, current, std::move(job.damage), &age);
+
+    // Images with a known age still hold their last presented contents, which we repair in place
 
     wren_transition(wren, cmd, current.image,
-        VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
-        0, VK_ACCESS_2_TRANSFER_WRITE_BIT,
-        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
-
-    wren->vk.CmdClearColorImage(cmd, current.image,
-        VK_IMAGE_LAYOUT_GENERAL,
-        wrei_ptr_to(VkClearColorValue{.float32{0.1f, 0.1f, 0.1f, 1.f}}),
-        1, wrei_ptr_to(VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}));
-
-    auto blit = [&](wren_image* image, wrei_vec2i32 offset = {}) {
-
-        wrei_vec2i32 extent = {image->extent.width, image->extent.height};
-
-        wrei_vec2i32 src_pos = {};
-        wrei_vec2i32 dst_pos = offset;
-
-        i32 overlap;
-
-        if ((overlap = -dst_pos.x) > 0) {
-            src_pos.x += overlap;
-            dst_pos.x = 0;
-            extent.x -= overlap;
-        }
-
-        if ((overlap = -dst_pos.y) > 0) {
-            src_pos.y += overlap;
-            dst_pos.y = 0;
-            extent.y -= overlap;
-        }
-
-        if ((overlap = dst_pos.x + extent.x - i32(current.extent.width)) > 0) {
-            extent.x -= overlap;
-        }
-
-        if ((overlap = dst_pos.y + extent.y - i32(current.extent.height)) > 0) {
-            extent.y -= overlap;
-        }
-
-        if (extent.x <= 0) return;
-        if (extent.y <= 0) return;
-
-        wren->vk.CmdBlitImage2(cmd, wrei_ptr_to(VkBlitImageInfo2 {
-            .sType = VK_STRUCTURE_TYPE_BLIT_IMAGE_INFO_2,
-            .srcImage = image->image,
-            .srcImageLayout = VK_IMAGE_LAYOUT_GENERAL,
-            .dstImage = current.image,
-            .dstImageLayout = VK_IMAGE_LAYOUT_GENERAL,
-            .regionCount = 1,
-            .pRegions = wrei_ptr_to(VkImageBlit2 {
-                .sType = VK_STRUCTURE_TYPE_IMAGE_BLIT_2,
-                .srcSubresource = VkImageSubresourceLayers{VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1},
-                .srcOffsets = {
-                    VkOffset3D {
-                        src_pos.x,
-                        src_pos.y,
-                    },
-                    VkOffset3D {
-                        src_pos.x + extent.x,
-                        src_pos.y + extent.y,
-                        1
-                    },
-                },
-                .dstSubresource = VkImageSubresourceLayers{VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1},
-                .dstOffsets = {
-                    VkOffset3D {
-                        dst_pos.x,
-                        dst_pos.y,
-                        0
-                    },
-                    VkOffset3D {
-                        dst_pos.x + extent.x,
-                        dst_pos.y + extent.y,
-                        1
-                    },
-                },
+        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+        0, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+        age ? VK_IMAGE_LAYOUT_PRESENT_SRC_KHR : VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+
+    for (auto& d : job.drawables) {
+        if (!d.init_layout) continue;
+        wren_transition(wren, cmd, d.image->image,
+            0, VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+            0, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+            VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+    }
+
+    wren->vk.CmdResetQueryPool(cmd, output->timestamp_queries, first_query, 2);
+    wren->vk.CmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, output->timestamp_queries, first_query);
+
+    // Walk front to back, removing everything hidden behind opaque content. Opaque areas are
+    // disjoint and can be drawn in any order without blending, whatever remains is blended back to front
+
+    std::vector<wroc_shader_instance> opaque_instances;
+    std::vector<wroc_shader_instance> blend_instances;
+    auto emit = [](std::vector<wroc_shader_instance>& instances, const wroc_render_drawable& d, const wrei_region& region, u32 flags) {
+        wrei_vec2f32 inv_extent = 1.f / wrei_vec2f32(d.image->image_extent.width, d.image->image_extent.height);
+        for (auto& box : region.boxes()) {
+            wrei_vec2i32 start = { box.x1, box.y1 };
+            wrei_vec2i32 end   = { box.x2, box.y2 };
+            instances.emplace_back(wroc_shader_instance {
+                .dst = wrei_vec4f32(start, end - start),
+                .src = wrei_vec4f32(wrei_vec2f32(start - d.rect.origin) * inv_extent, wrei_vec2f32(end - start) * inv_extent),
+                .image = d.image->descriptor,
+                .flags = flags,
+            });
+        }
+    };
+
+    // Multi-planar images are sampled through a descriptor set of their own, so each is drawn separately
+
+    struct ycbcr_batch
+    {
+        wren_image* image;
+        u32 first;
+        u32 count;
+    };
+    std::vector<wroc_shader_instance> ycbcr_instances;
+    std::vector<ycbcr_batch> ycbcr_batches;
+
+    wrei_region covered;
+    for (auto& d : job.drawables | std::views::reverse) {
+        wrei_region visible = repaint;
+        visible.intersect(d.rect);
+        visible.subtract(covered);
+        if (visible.empty()) continue;
+
+        // Multi-planar formats have no alpha, and are never blended
+
+        wrei_region opaque = visible;
+        if (!d.image->ycbcr) opaque.intersect(d.opaque);
+        visible.subtract(opaque);
+
+        if (d.image->ycbcr) {
+            u32 first = u32(ycbcr_instances.size());
+            emit(ycbcr_instances, d, opaque, wroc_instance_opaque);
+            ycbcr_batches.emplace_back(d.image.get(), first, u32(ycbcr_instances.size()) - first);
+        } else {
+            emit(opaque_instances, d, opaque, wroc_instance_opaque);
+        }
+        covered.add(opaque);
+
+        emit(blend_instances, d, visible, 0);
+    }
+
+    // Boxes from a single surface never overlap, so reversing the whole list restores back to front order
+    std::ranges::reverse(blend_instances);
+
+    if (!repaint.empty()) {
+        wren->vk.CmdBeginRendering(cmd, wrei_ptr_to(VkRenderingInfo {
+            .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+            .renderArea = { {}, current.extent },
+            .layerCount = 1,
+            .colorAttachmentCount = 1,
+            .pColorAttachments = wrei_ptr_to(VkRenderingAttachmentInfo {
+                .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+                .imageView = current.view,
+                .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+                .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+                .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
             }),
-            .filter = VK_FILTER_NEAREST,
         }));
+
+        // Only clear what no opaque content will cover
+
+        wrei_region background = repaint;
+        background.subtract(covered);
+
+        std::vector<VkClearRect> clear_rects;
+        for (auto& box : background.boxes()) {
+            clear_rects.emplace_back(VkClearRect {
+                .rect = { {box.x1, box.y1}, {u32(box.x2 - box.x1), u32(box.y2 - box.y1)} },
+                .layerCount = 1,
+            });
+        }
+
+        if (!clear_rects.empty()) {
+            wren->vk.CmdClearAttachments(cmd, 1, wrei_ptr_to(VkClearAttachment {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .clearValue = { .color{.float32{0.1f, 0.1f, 0.1f, 1.f}} },
+            }), u32(clear_rects.size()), clear_rects.data());
+        }
+
+        // Instances are laid out as opaque, then multi-planar, then blended
+
+        u32 ycbcr_base = u32(opaque_instances.size());
+        u32 blend_base = ycbcr_base + u32(ycbcr_instances.size());
+        usz instance_count = blend_base + blend_instances.size();
+        if (instance_count) {
+            auto* mapped = wroc_renderer_reserve_instances(renderer, job, frame, instance_count);
+            std::ranges::copy(opaque_instances, mapped);
+            std::ranges::copy(ycbcr_instances, mapped + ycbcr_base);
+            std::ranges::copy(blend_instances, mapped + blend_base);
+
+            auto& pipelines = wroc_renderer_get_pipelines(renderer, output->format.format);
+
+            wren->vk.CmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, wren->pipeline_layout, 0, 1, &wren->set, 0, nullptr);
+
+            wren->vk.CmdSetViewport(cmd, 0, 1, wrei_ptr_to(VkViewport {
+                .width = f32(current.extent.width),
+                .height = f32(current.extent.height),
+                .minDepth = 0.f,
+                .maxDepth = 1.f,
+            }));
+            wren->vk.CmdSetScissor(cmd, 0, 1, wrei_ptr_to(VkRect2D { {}, current.extent }));
+
+            wren->vk.CmdPushConstants(cmd, wren->pipeline_layout, VK_SHADER_STAGE_ALL, 0, sizeof(wroc_shader_push_constants),
+                wrei_ptr_to(wroc_shader_push_constants {
+                    .instances = frame.instances->device_address,
+                    .output_size = wrei_vec2f32(current.extent.width, current.extent.height),
+                }));
+
+            if (!opaque_instances.empty()) {
+                wren->vk.CmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.opaque);
+                wren->vk.CmdDraw(cmd, 4, u32(opaque_instances.size()), 0, 0);
+            }
+
+            // Conversion pipeline layouts only add set 1, so set 0 and the push constants stay bound
+
+            for (auto& batch : ycbcr_batches) {
+                auto* ycbcr = batch.image->ycbcr;
+                wren->vk.CmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, wroc_renderer_get_ycbcr_pipeline(renderer, output->format.format, ycbcr));
+                wren->vk.CmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, ycbcr->pipeline_layout, 1, 1, &batch.image->ycbcr_set, 0, nullptr);
+                wren->vk.CmdDraw(cmd, 4, batch.count, 0, ycbcr_base + batch.first);
+            }
+
+            if (!blend_instances.empty()) {
+                wren->vk.CmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.blend);
+                wren->vk.CmdDraw(cmd, 4, u32(blend_instances.size()), 0, blend_base);
+            }
+        }
+
+        wren->vk.CmdEndRendering(cmd);
+    }
+
+    wren->vk.CmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, output->timestamp_queries, first_query + 1);
+    frame.timestamps_written = true;
+
+    wren_transition(wren, cmd, current.image,
+        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, 0,
+        VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT, 0,
+        VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+
+    wren_check(wren->vk.EndCommandBuffer(cmd));
+
+    // Rendering waits on the swapchain acquire and the uploads it samples from,
+    // and presentation waits on rendering, all without blocking the CPU
+
+    std::array waits {
+        VkSemaphoreSubmitInfo {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = output->timeline,
+            .value = output->timeline_value,
+            .stageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+        },
+        VkSemaphoreSubmitInfo {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = wren->timeline,
+            .value = job.upload_value,
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        },
     };
 
-    blit(output->server->renderer->image.get());
+    frame.timeline_value = job.timeline_value;
+
+    std::scoped_lock queue_lock{wren->queue_mutex};
+
+    wren_check(wren->vk.QueueSubmit2(wren->queue, 1, wrei_ptr_to(VkSubmitInfo2 {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+        .waitSemaphoreInfoCount = u32(waits.size()),
+        .pWaitSemaphoreInfos = waits.data(),
+        .commandBufferInfoCount = 1,
+        .pCommandBufferInfos = wrei_ptr_to(VkCommandBufferSubmitInfo {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+            .commandBuffer = cmd,
+        }),
+        .signalSemaphoreInfoCount = 1,
+        .pSignalSemaphoreInfos = wrei_ptr_to(VkSemaphoreSubmitInfo {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = renderer->timeline,
+            .value = job.timeline_value,
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        }),
+    }), nullptr));
+
+    frame.cpu_time = std::chrono::steady_clock::now() - cpu_start;
+
+    // Feedback must be requested immediately before the commit performed by present
+
+    if (job.presentation_feedback) {
+        wroc_backend_output_request_presentation_feedback(output);
+    }
+
+    // The swapchain is recreated by a later acquire, see wroc_output_take_repaint_region
+
+    if (wren_check(vkwsi_swapchain_present(&output->swapchain, 1, wren->queue, wrei_ptr_to(VkSemaphoreSubmitInfo {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .semaphore = renderer->timeline,
+        .value = job.timeline_value,
+    }), 1, false), VK_SUBOPTIMAL_KHR, VK_ERROR_OUT_OF_DATE_KHR) != VK_SUCCESS) {
+        output->swapchain_invalidated = true;
+    }
+}
+
+static
+void wroc_render_thread(std::stop_token stop, wroc_renderer* renderer)
+{
+    for (;;) {
+        wroc_render_job job;
+
+        {
+            std::unique_lock lock{renderer->mutex};
+            if (!renderer->cv.wait(lock, stop, [&] { return !renderer->queue.empty(); })) return;
+
+            job = std::move(renderer->queue.front());
+            renderer->queue.pop_front();
+            renderer->rendering = true;
+        }
+
+        wroc_render_output(renderer, job);
+
+        {
+            std::scoped_lock lock{renderer->mutex};
+            renderer->submitted_value = job.timeline_value;
+            renderer->completed.emplace_back(std::move(job));
+            renderer->rendering = false;
+        }
+
+        renderer->cv.notify_all();
+        eventfd_write(renderer->completion_fd, 1);
+    }
+}
+
+static
+void wroc_renderer_completion_thread(std::stop_token stop, wroc_renderer* renderer)
+{
+    auto* wren = renderer->wren.get();
+
+    u64 completed = 0;
+    for (;;) {
+        u64 value;
+        {
+            std::unique_lock lock{renderer->mutex};
+            if (!renderer->cv.wait(lock, stop, [&] { return renderer->submitted_value > completed; })) return;
+            value = renderer->submitted_value;
+        }
+
+        // Wait in short slices, so that shutdown isn't held up by a stuck GPU
+
+        VkResult res;
+        do {
+            res = wren->vk.WaitSemaphores(wren->device, wrei_ptr_to(VkSemaphoreWaitInfo {
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+                .semaphoreCount = 1,
+                .pSemaphores = &renderer->timeline,
+                .pValues = &value,
+            }), std::chrono::nanoseconds(100ms).count());
+        } while (res == VK_TIMEOUT && !stop.stop_requested());
+
+        if (wren_check(res, VK_TIMEOUT) != VK_SUCCESS) return;
+
+        completed = value;
+        eventfd_write(renderer->completion_fd, 1);
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+u64 wroc_renderer_get_completed_value(wroc_renderer* renderer)
+{
+    u64 value = 0;
+    wren_check(renderer->wren->vk.GetSemaphoreCounterValue(renderer->wren->device, renderer->timeline, &value));
+    return value;
+}
+
+static
+void wroc_renderer_retire_completed(wroc_renderer* renderer)
+{
+    std::deque<wroc_render_job> completed;
+    {
+        std::scoped_lock lock{renderer->mutex};
+        std::swap(completed, renderer->completed);
+    }
+
+    for (auto& job : completed) {
+        auto* output = job.output;
+        if (job.render_time) {
+            wroc_output_add_render_time(output, *job.render_time);
+        }
+
+        // Requests made while the render thread was busy were held back until now
+
+        output->render_pending = false;
+        bool removed = std::ranges::find(output->server->outputs, output) == output->server->outputs.end();
+        if (!removed && output->frame_requested && !output->scheduler.render_scheduled) {
+            wroc_backend_output_request_frame(output);
+        }
+
+        renderer->retired.emplace_back(std::move(job));
+    }
+
+    // Buffers read by frames or directly by uploads are released once the frame that last used them completes
+
+    wroc_wl_buffer_release_completed(renderer->server);
+
+    u64 value = wroc_renderer_get_completed_value(renderer);
+    std::erase_if(renderer->retired, [&](const wroc_render_job& job) {
+        return job.timeline_value <= value;
+    });
+}
+
+static
+int wroc_renderer_handle_completion(int fd, u32, void* data)
+{
+    eventfd_t count;
+    eventfd_read(fd, &count);
+
+    wroc_renderer_retire_completed(static_cast<wroc_renderer*>(data));
+
+    return 0;
+}
+
+void wroc_renderer_flush(wroc_renderer* renderer)
+{
+    {
+        std::unique_lock lock{renderer->mutex};
+        renderer->cv.wait(lock, [&] { return renderer->queue.empty() && !renderer->rendering; });
+    }
+
+    wroc_renderer_retire_completed(renderer);
+}
+
+// Submits uploads recorded on this thread to the transfer queue, returning the wren timeline value that
+// signals their completion. Uploads into images that no queued frame is still reading start immediately,
+// and can overlap with composition of earlier frames
+
+static
+u64 wroc_renderer_submit_uploads(wroc_renderer* renderer)
+{
+    std::array waits {
+        VkSemaphoreSubmitInfo {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = renderer->timeline,
+            .value = renderer->upload_wait_value,
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        },
+    };
+
+    bool wait = renderer->upload_wait_value > wroc_renderer_get_completed_value(renderer);
+    u64 value = wren_submit(renderer->wren.get(), std::span(waits).first(wait ? 1 : 0));
+    renderer->upload_wait_value = 0;
+
+    return value;
+}
+
+static
+void wroc_renderer_queue_output(wroc_output* output)
+{
+    auto* renderer = output->server->renderer.get();
+
+    wroc_renderer_retire_completed(renderer);
+    wroc_wl_buffer_release_completed(output->server);
+
+    wroc_render_job job {
+        .output = output,
+        .size = output->size,
+        .damage = std::move(output->damage),
+    };
+    output->damage.clear();
+
+    // Capture everything that may be drawn, back to front
+
+    if (auto* wallpaper = renderer->image.get()) {
+        wrei_rect<i32> rect = { {}, {wallpaper->extent.width, wallpaper->extent.height} };
+        job.drawables.push_back({ nullptr, wallpaper, rect, wrei_region(rect) });
+    }
 
-    output->server->toplevel_under_cursor.reset();
     for (wroc_surface* surface : output->server->surfaces) {
+        auto* xdg_surface = wroc_xdg_surface::try_from(surface);
+        if (!xdg_surface) continue;
+
+        auto* buffer = surface->displayed_buffer.get();
+        if (!buffer || !buffer->image) continue;
+        if (buffer->image->descriptor == ~0u && !buffer->image->ycbcr_set) continue;
+
+        // The displayed buffer may trail the current buffer, and differ in size, while its upload is deferred
+
+        auto rect = wroc_xdg_surface_get_layout_rect(xdg_surface);
+        rect.origin -= wrei_vec2i32(output->position);
+        rect.extent = buffer->extent;
+
+        wrei_region opaque;
+        if (buffer->opaque) {
+            opaque = wrei_region(rect);
+        } else if (!surface->current.opaque_region.empty()) {
+            opaque = surface->current.opaque_region;
+            opaque.translate(rect.origin);
+            opaque.intersect(rect);
+        }
+
+        // Jobs execute in order on the graphics queue, so only the first needs to transition the image
+
+        bool init_layout = std::exchange(buffer->image->layout_pending, false);
+
+        job.drawables.push_back({ buffer, buffer->image.get(), rect, std::move(opaque), init_layout });
+    }
+
+    job.upload_value = wroc_renderer_submit_uploads(renderer);
+    job.timeline_value = ++renderer->timeline_value;
+
+    // Client buffers must not be released while being read
+
+    for (auto& d : job.drawables) {
+        if (d.buffer) d.buffer->last_use = job.timeline_value;
+    }
+
+    // Targets are recorded in queue order, which is also the order that jobs are presented in
+
+    if (wroc_backend_output_supports_presentation_feedback(output)) {
+        output->scheduler.pending_targets.emplace_back(wroc_output_predict_presentation(output, std::chrono::steady_clock::now()));
+        job.presentation_feedback = true;
+    }
+
+    output->render_pending = true;
+
+    {
+        std::scoped_lock lock{renderer->mutex};
+        renderer->queue.emplace_back(std::move(job));
+    }
+    renderer->cv.notify_all();
+}
+
+
+// Only the latest buffer committed to each surface since the last frame is uploaded, so clients committing
+// faster than the refresh rate never pay for contents that are never shown. All uploads share one submission.
+//
+// Uploads are limited by a per frame byte and time budget, taken in priority order. Surfaces over budget
+// keep displaying their previous buffer until a later frame, so that upload storms don't blow the deadline
+
+void wroc_surface_finish_upload(wroc_surface* surface, wroc_wl_buffer* buffer)
+{
+    auto previous = std::move(surface->displayed_buffer);
+    auto previous_extent = previous ? previous->extent : wrei_vec2i32{};
+
+    surface->displayed_buffer = buffer ? buffer : surface->current.buffer.get();
+
+    // Dmabufs are sampled directly, so a superseded one is held until it leaves the screen
+
+    if (previous && previous.get() != surface->displayed_buffer.get() && previous->type == wroc_wl_buffer_type::dma) {
+        previous->unlock();
+    }
+
+    // Damage for the commit was spent on frames that still showed the previous buffer
+
+    if (surface->upload_deferred) {
+        surface->upload_deferred = false;
         if (auto* xdg_surface = wroc_xdg_surface::try_from(surface)) {
-            if (surface->current.buffer && surface->current.buffer->image) {
-                auto geom = wroc_xdg_surface_get_geometry(xdg_surface);
-                blit(surface->current.buffer->image.get(), xdg_surface->position - wrei_vec2f64(geom.origin));
-            }
+            auto rect = wroc_xdg_surface_get_layout_rect(xdg_surface);
+            wroc_damage_layout(surface->server, rect);
+            wroc_damage_layout(surface->server, wrei_rect<i32>{rect.origin, previous_extent});
+        }
+    }
+}
+
+void wroc_flush_pending_uploads(wroc_server* server)
+{
+    auto* keyboard = server->seat->keyboard;
+    auto* focused = keyboard ? keyboard->focused_surface.get() : nullptr;
+
+    auto is_visible = [&](wroc_surface* surface) {
+        auto* xdg_surface = wroc_xdg_surface::try_from(surface);
+        if (!xdg_surface) return false;
+        auto rect = wroc_xdg_surface_get_layout_rect(xdg_surface);
+        return std::ranges::any_of(server->outputs, [&](wroc_output* output) {
+            wrei_region region(rect);
+            region.intersect({wrei_vec2i32(output->position), output->size});
+            return !region.empty();
+        });
+    };
+
+    // Focused surface first, then anything visible on an output, then everything else
+
+    std::vector<std::pair<u32, wroc_surface*>> pending;
+    for (wroc_surface* surface : server->surfaces) {
+        if (!surface->upload_pending) continue;
+
+        auto* buffer = surface->current.buffer.get();
+        if (!buffer || buffer->type != wroc_wl_buffer_type::shm) {
+            surface->upload_pending = false;
+            continue;
         }
+
+        // Wait for the copy already reading the buffer, its completion requests another frame
+        if (buffer->reading) continue;
+
+        u32 priority = surface == focused ? 0 : is_visible(surface) ? 1 : 2;
+        pending.emplace_back(priority, surface);
+    }
+    std::ranges::stable_sort(pending, {}, &std::pair<u32, wroc_surface*>::first);
+
+    auto start = std::chrono::steady_clock::now();
+    usz bytes = 0;
+    bool deferred = false;
+
+    for (wroc_surface* surface : pending | std::views::values) {
+        auto* buffer = static_cast<wroc_shm_buffer*>(surface->current.buffer.get());
+        usz size = buffer->get_upload_size();
+
+        // At least one upload always goes ahead, so that a single large buffer can't stall forever
+
+        if (bytes && (bytes + size > server->upload_budget_bytes
+                || std::chrono::steady_clock::now() - start > server->upload_budget_time)) {
+            surface->upload_deferred = true;
+            deferred = true;
+            continue;
+        }
+
+        bytes += size;
+        surface->upload_pending = false;
+
+        if (buffer->upload(surface)) {
+            wroc_surface_finish_upload(surface);
+        } else {
+            // Frames built while the copy runs still show the previous buffer
+            surface->upload_deferred = true;
+        }
+    }
+
+    if (deferred) {
+        wroc_request_frame(server);
     }
+}
 
-    if (auto* pointer = output->server->seat->pointer) {
-        for (wroc_surface* surface : output->server->surfaces) {
+void wroc_update_toplevel_under_cursor(wroc_server* server)
+{
+    server->toplevel_under_cursor.reset();
+    if (auto* pointer = server->seat->pointer) {
+        for (wroc_surface* surface : server->surfaces) {
             if (!surface->current.buffer) continue;
             if (auto* toplevel = wroc_xdg_toplevel::try_from(surface)) {
                 auto geom = wroc_xdg_surface_get_geometry(toplevel->base.get());
                 auto surface_position = pointer->layout_position - toplevel->base->position + wrei_vec2f64(geom.origin);
                 if (wroc_surface_point_accepts_input(surface, surface_position)) {
-                    output->server->toplevel_under_cursor = wrei_weak_from(toplevel);
+                    server->toplevel_under_cursor = wrei_weak_from(toplevel);
                 }
             }
         }
     }
+}
 
-    wren_transition(wren, cmd, current.image,
-        VK_PIPELINE_STAGE_2_TRANSFER_BIT, 0,
-        VK_ACCESS_2_TRANSFER_WRITE_BIT, 0,
-        VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+void wroc_render_frame(wroc_output* output)
+{
+    // Record uploads before anything is captured, so that every output draws up to date contents. Uploads
+    // are flushed once per frame rather than per output, so that the upload budget holds with any number of
+    // outputs. A frame starts with the first output to render again since the previous flush
 
-    wren_submit_commands(wren, cmd);
-    wren_check(vkwsi_swapchain_present(&output->swapchain, 1, wren->queue, nullptr, 0, false));
+    if (!output->uploads_flushed) {
+        wroc_flush_pending_uploads(output->server);
+        for (auto* other : output->server->outputs) {
+            other->uploads_flushed = true;
+        }
+    }
+    output->uploads_flushed = false;
+
+    // Latch the newest pointer state, so that hit testing and drawing see the same layout
+
+    wroc_latch_movesize_interaction(output->server, output);
+    wroc_update_toplevel_under_cursor(output->server);
+
+    // Only render and present when something on the output changed
+
+    if (!output->damage.empty()) {
+        wroc_renderer_queue_output(output);
+    } else if (wren_has_pending_work(output->server->renderer->wren.get())) {
+        // Uploads for surfaces that are off-screen or occluded would otherwise hold on to staging
+        // space until unrelated damage arrives
+        wroc_renderer_submit_uploads(output->server->renderer.get());
+    }
 
     auto elapsed = wroc_get_elapsed_milliseconds(output->server);
 
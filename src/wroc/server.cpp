@@ -12,6 +12,25 @@ u32 wroc_get_elapsed_milliseconds(wroc_server* server)
     return std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
 }
 
+// Reads a tuning knob in [0, max] from the environment. Anything else is ignored, keeping the default
+
+static
+std::optional<f64> wroc_getenv_number(const char* name, f64 max)
+{
+    const char* str = getenv(name);
+    if (!str) return std::nullopt;
+
+    f64 value;
+    const char* end = str + strlen(str);
+    auto res = std::from_chars(str, end, value);
+    if (res.ec != std::errc{} || res.ptr != end || !(value >= 0 && value <= max)) {
+        log_warn("Ignoring {}=\"{}\", expected a number between 0 and {}", name, str, max);
+        return std::nullopt;
+    }
+
+    return value;
+}
+
 void wroc_run(int argc, char* argv[])
 {
     wrei_ref server = wrei_adopt_ref(new wroc_server {});
@@ -22,6 +41,29 @@ void wroc_run(int argc, char* argv[])
 
     server->epoch = std::chrono::steady_clock::now();
 
+    if (auto margin = wroc_getenv_number("WROC_RENDER_SAFETY_MARGIN_MS", 1000)) {
+        server->render_safety_margin = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<f64, std::milli>(*margin));
+        log_info("Render safety margin: {}", wrei_duration_to_string(server->render_safety_margin));
+    }
+
+    if (auto prediction = wroc_getenv_number("WROC_POINTER_PREDICTION_MS", 1000)) {
+        server->pointer_prediction = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<f64, std::milli>(*prediction));
+        log_info("Pointer prediction: {}", wrei_duration_to_string(server->pointer_prediction));
+    }
+
+    if (auto budget = wroc_getenv_number("WROC_UPLOAD_BUDGET_MB", 1024 * 1024)) {
+        server->upload_budget_bytes = usz(*budget * 1024 * 1024);
+        log_info("Upload budget: {} MiB per frame", server->upload_budget_bytes >> 20);
+    }
+
+    if (auto budget = wroc_getenv_number("WROC_UPLOAD_BUDGET_MS", 1000)) {
+        server->upload_budget_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<f64, std::milli>(*budget));
+        log_info("Upload time budget: {} per frame", wrei_duration_to_string(server->upload_budget_time));
+    }
+
     if (getenv("WROC_WAYLAND_DEBUG_SERVER")) {
         setenv("WAYLAND_DEBUG", "1", true);
     } else {
@@ -33,6 +75,9 @@ void wroc_run(int argc, char* argv[])
 
     wroc_backend_init(server.get());
     wroc_renderer_create(server.get());
+    wroc_shm_select_upload_path(server.get());
+    wroc_shm_init_formats(server.get());
+    wroc_dmabuf_init_formats(server.get());
 
     const char* socket = wl_display_add_socket_auto(server->display);
 
@@ -41,7 +86,9 @@ void wroc_run(int argc, char* argv[])
     wl_global_create(server->display, &xdg_wm_base_interface,   xdg_wm_base_interface.version,   server.get(), wroc_xdg_wm_base_bind_global);
     wl_global_create(server->display, &wl_seat_interface,       wl_seat_interface.version,       server->seat.get(),   wroc_wl_seat_bind_global);
 
-    wl_global_create(server->display, &zwp_linux_dmabuf_v1_interface, 3/* zwp_linux_dmabuf_v1_interface.version */, server.get(), wroc_zwp_linux_dmabuf_v1_bind_global);
+    // Feedback needs the format table and the device node, otherwise only advertise formats on bind
+    u32 dmabuf_version = server->dmabuf_formats.table_fd >= 0 ? 4 : 3;
+    wl_global_create(server->display, &zwp_linux_dmabuf_v1_interface, dmabuf_version, server.get(), wroc_zwp_linux_dmabuf_v1_bind_global);
 
     log_info("Running compositor on: {}", socket);
 
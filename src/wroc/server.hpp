@@ -10,6 +10,8 @@
 
 #include "wren/wren_helpers.hpp"
 
+#include "wrei/task_pool.hpp"
+
 // -----------------------------------------------------------------------------
 
 struct wroc_server;
@@ -30,6 +32,50 @@ void wroc_backend_destroy(wroc_backend*);
 
 // -----------------------------------------------------------------------------
 
+static constexpr u32 wroc_output_damage_history_size = 4;
+static constexpr u32 wroc_output_frames_in_flight = 2;
+
+// Owned by the render thread once the output has been added
+
+struct wroc_output_frame
+{
+    VkCommandPool pool;
+    VkCommandBuffer cmd;
+
+    // Renderer timeline value signalled once the GPU has finished this frame
+    u64 timeline_value;
+
+    wrei_ref<wren_buffer> instances;
+
+    // CPU time spent building the frame, GPU time is read back from timestamp queries once complete
+    std::chrono::nanoseconds cpu_time;
+    bool timestamps_written;
+};
+
+static constexpr u32 wroc_output_render_time_samples = 32;
+static constexpr u32 wroc_output_stats_interval = 1000;
+
+struct wroc_output_scheduler
+{
+    // Most recent host presentation, on the steady (monotonic) clock
+    std::chrono::steady_clock::time_point last_presentation;
+    std::chrono::nanoseconds refresh;
+
+    // Presentation times targeted by frames awaiting feedback, oldest first
+    std::vector<std::chrono::steady_clock::time_point> pending_targets;
+
+    // Recent CPU + GPU render durations, the maximum is used as the prediction
+    std::array<std::chrono::nanoseconds, wroc_output_render_time_samples> render_times;
+    u32 render_time_index;
+
+    wl_event_source* timer;
+    bool render_scheduled;
+
+    u64 frames_presented;
+    u64 frames_discarded;
+    u64 deadlines_missed;
+};
+
 struct wroc_output : wrei_object
 {
     wroc_server* server;
@@ -43,12 +89,60 @@ struct wroc_output : wrei_object
     vkwsi_swapchain* swapchain;
 
     wrei_vec2f64 position;
+
+    // Damage accumulated since the last frame, in output local coordinates
+    wrei_region damage;
+
+    // Damage of previous frames, most recent first, used to repair swapchain images by age.
+    // These, the swapchain and the frames below are owned by the render thread
+    std::array<wrei_region, wroc_output_damage_history_size> damage_history;
+    std::vector<std::pair<VkImage, u64>> image_frames;
+    wrei_vec2i32 frame_extent;
+
+    // Acquire or present reported the swapchain as suboptimal or out of date, so it may have been
+    // recreated, and a new image could reuse the handle of an old one
+    bool swapchain_invalidated = false;
+    u64 frame_count = 0;
+
+    std::array<wroc_output_frame, wroc_output_frames_in_flight> frames;
+    u32 frame_index = 0;
+
+    // Set when something changed that requires the next frame to be handled
+    bool frame_requested = false;
+
+    // A frame has been handed to the render thread and has not yet been returned
+    bool render_pending = false;
+
+    // Pending uploads have been flushed since this output last rendered, see wroc_render_frame
+    bool uploads_flushed = false;
+
+    VkQueryPool timestamp_queries;
+    wroc_output_scheduler scheduler;
 };
 
-vkwsi_swapchain_image wroc_output_acquire_image(wroc_output*);
+vkwsi_swapchain_image wroc_output_acquire_image(wroc_output*, wrei_vec2i32 size);
+wrei_region wroc_output_take_repaint_region(wroc_output*, const vkwsi_swapchain_image&, wrei_region damage, u32* age);
+
+// Damage to an output whose frame is being built is folded into that frame, without requesting another
+void wroc_damage_layout(wroc_server*, wrei_rect<i32> rect, wroc_output* building = nullptr);
+void wroc_damage_layout(wroc_server*, const wrei_region& region, wroc_output* building = nullptr);
+
+void wroc_output_request_frame(wroc_output*);
+void wroc_request_frame(wroc_server*);
+
+std::chrono::steady_clock::time_point wroc_output_predict_presentation(wroc_output*, std::chrono::steady_clock::time_point now);
+void wroc_output_add_render_time(wroc_output*, std::chrono::nanoseconds);
+void wroc_output_presented(wroc_output*, std::chrono::steady_clock::time_point presentation, std::chrono::nanoseconds refresh);
+void wroc_output_discarded(wroc_output*);
 
 void wroc_backend_output_create(wroc_backend*);
 void wroc_backend_output_destroy(wroc_output*);
+void wroc_backend_output_request_frame(wroc_output*);
+
+// Presentation feedback is requested on the render thread immediately before present, so that it is bound to
+// the commit performed by present. Returns false if the backend can't report presentation times
+bool wroc_backend_output_supports_presentation_feedback(wroc_output*);
+void wroc_backend_output_request_presentation_feedback(wroc_output*);
 
 // -----------------------------------------------------------------------------
 
@@ -93,6 +187,7 @@ enum class wroc_surface_committed_state : u32
     offset       = 1 << 1,
     input_region = 1 << 2,
     buffer_scale = 1 << 3,
+    opaque_region = 1 << 4,
 };
 WREI_DECORATE_FLAG_ENUM(wroc_surface_committed_state)
 
@@ -104,7 +199,31 @@ struct wroc_surface_state
     wrei_wl_resource_list frame_callbacks;
     wrei_vec2i32 offset;
     wrei_region input_region;
+    wrei_region opaque_region;
     double buffer_scale;
+
+    wrei_region surface_damage;
+    wrei_region buffer_damage;
+};
+
+struct wroc_buffer_fence
+{
+    int fd;
+    wl_event_source* source;
+};
+
+// A committed dmabuf that isn't displayed until its implicit write fences have all signalled
+struct wroc_fenced_buffer
+{
+    wroc_surface* surface;
+
+    wrei_ref<wroc_wl_buffer> buffer;
+    std::vector<wroc_buffer_fence> fences;
+
+    // Frame callbacks committed with or after the buffer, sent once it or a newer buffer is displayed
+    wrei_wl_resource_list frame_callbacks;
+
+    ~wroc_fenced_buffer();
 };
 
 struct wroc_surface : wrei_object
@@ -123,9 +242,39 @@ struct wroc_surface : wrei_object
 
     wroc_surface_addon* role_addon;
 
+    // Buffers recently committed to this surface, which fall behind by any damage committed since
+    std::vector<wrei_weak<wroc_wl_buffer>> committed_buffers;
+
+    // The current buffer's contents are uploaded when the next frame is built, see wroc_flush_pending_uploads
+    bool upload_pending = false;
+
+    // Set once a pending upload has been held back by the upload budget for at least one frame
+    bool upload_deferred = false;
+
+    // Buffer whose image is drawn. Trails the current buffer while its upload is pending
+    wrei_ref<wroc_wl_buffer> displayed_buffer;
+
+    // Committed dmabufs still waiting on their fences, oldest first. Whichever becomes ready is displayed
+    // and replaces every older one, so a client rendering ahead never has its buffers cancelled
+    std::vector<std::unique_ptr<wroc_fenced_buffer>> fenced_buffers;
+
+    // zwp_linux_dmabuf_feedback_v1 objects for this surface, and whether they were last sent the scanout tranche
+    wrei_wl_resource_list dmabuf_feedbacks;
+    bool dmabuf_feedback_scanout = false;
+
     ~wroc_surface();
 };
 
+// Makes the current buffer the displayed one once its upload has been recorded, or buffer once its fences
+// have signalled
+void wroc_surface_finish_upload(wroc_surface*, wroc_wl_buffer* buffer = nullptr);
+
+// Replaces the oldest count fenced buffers without displaying them, their frame callbacks are sent with the
+// next frame
+void wroc_surface_drop_fenced_buffers(wroc_surface*, usz count);
+
+static constexpr u32 wroc_surface_max_committed_buffers = 4;
+
 bool wroc_surface_point_accepts_input(wroc_surface*, wrei_vec2f64 point);
 
 // -----------------------------------------------------------------------------
@@ -172,6 +321,7 @@ struct wroc_xdg_surface : wroc_surface_addon
 };
 
 wrei_rect<i32> wroc_xdg_surface_get_geometry(wroc_xdg_surface* surface);
+wrei_rect<i32> wroc_xdg_surface_get_layout_rect(wroc_xdg_surface* surface);
 void wroc_xdg_surface_flush_configure(wroc_xdg_surface* surface);
 
 // -----------------------------------------------------------------------------
@@ -259,16 +409,63 @@ struct wroc_wl_buffer : wrei_object
 
     wrei_ref<wren_image> image;
 
+    // Buffer format has no alpha channel, contents must be treated as fully opaque
+    bool opaque = false;
+
+    // Last renderer timeline value at which the GPU may read from the buffer
+    u64 last_use = 0;
+
+    // Area of the buffer, in buffer coordinates, that its image does not yet reflect
+    wrei_region stale;
+
     bool locked = false;
 
+    // Contents are being copied out on a worker thread, release is held until the copy completes
+    bool reading = false;
+
     void lock();
     void unlock();
 
-    virtual void on_commit() = 0;
+    virtual void on_commit(wroc_surface*) = 0;
 };
 
+void wroc_wl_buffer_release_completed(wroc_server*);
+
 // -----------------------------------------------------------------------------
 
+enum class wroc_shm_upload_path
+{
+    // Copy into the staging ring, then record a buffer to image copy
+    staging,
+
+    // Record a copy straight from the pool, imported with VK_EXT_external_memory_host
+    host_import,
+
+    // Write into the image from the host with VK_EXT_host_image_copy, without recording any commands
+    host_copy,
+};
+
+// Chooses the upload path from WROC_SHM_UPLOAD_PATH (staging, host_import, host_copy or auto) and device support
+void wroc_shm_select_upload_path(wroc_server*);
+
+// A format advertised by wl_shm, and how buffers of that format are uploaded
+struct wroc_shm_format
+{
+    wl_shm_format shm;
+
+    // Format of the client's pixels
+    wren_format format;
+
+    // Converts client rows into image_format, for formats the device can't sample. Null if uploaded as is
+    const wrei_pixel_converter* converter;
+
+    VkFormat image_format;
+    u32 image_texel_size;
+};
+
+// Collects every format that can be sampled natively or converted. Set WROC_SHM_CONVERT_BENCHMARK to compare conversion kernels
+void wroc_shm_init_formats(wroc_server*);
+
 struct wroc_wl_shm : wrei_object
 {
     wroc_server* server;
@@ -276,6 +473,20 @@ struct wroc_wl_shm : wrei_object
     wrei_wl_resource wl_shm;
 };
 
+// Pool memory mapped into the compositor. Resizing a pool replaces its mapping, worker copies
+// still reading from the old one hold a reference to it until they complete
+
+struct wroc_shm_mapping : wrei_object
+{
+    void* data;
+    usz size;
+
+    // Mapping imported as a transfer source, null if host memory import is unavailable
+    wrei_ref<wren_host_buffer> host_buffer;
+
+    ~wroc_shm_mapping();
+};
+
 struct wroc_wl_shm_pool : wrei_object
 {
     wroc_server* server;
@@ -284,7 +495,9 @@ struct wroc_wl_shm_pool : wrei_object
 
     i32 size;
     int fd;
-    void* data;
+
+    // Null if mapping the pool failed
+    wrei_ref<wroc_shm_mapping> mapping;
 
     ~wroc_wl_shm_pool();
 };
@@ -295,11 +508,47 @@ struct wroc_shm_buffer : wroc_wl_buffer
 
     i32 offset;
     i32 stride;
-    wl_shm_format format;
+    const wroc_shm_format* format;
 
-    virtual void on_commit() final override;
+    // Renderer timeline value of the job that flushes the last copy recorded into the image
+    u64 recorded_upload_use = 0;
+
+    virtual void on_commit(wroc_surface*) final override;
+
+    // Brings the image up to date with the buffer contents, then unlocks the buffer.
+    // Returns false if the contents are still being copied out on worker threads
+    bool upload(wroc_surface*);
+
+    // Estimated number of bytes that the next upload will copy
+    usz get_upload_size();
+};
+
+// Uploads of at least this many bytes are copied out of the pool by worker threads
+static constexpr usz wroc_shm_parallel_copy_threshold = 4 * 1024 * 1024;
+
+// Smallest share of a parallel copy given to a single worker
+static constexpr usz wroc_shm_copy_band_size = 1024 * 1024;
+
+// Rows of a shm buffer being copied into a staging buffer in bands, one task per band
+struct wroc_shm_copy
+{
+    wrei_ref<wroc_shm_buffer> buffer;
+    wrei_weak<wroc_surface> surface;
+
+    // Kept mapped until the copy completes, even if the pool is resized in the meantime
+    wrei_ref<wroc_shm_mapping> mapping;
+
+    wrei_ref<wren_buffer> staging;
+    usz staging_stride;
+    std::vector<VkRect2D> rects;
+    u32 first_row;
+
+    // Bands not yet copied, the worker that finishes the last one reports the copy as completed
+    std::atomic<u32> remaining;
 };
 
+int wroc_shm_handle_copy_completion(int fd, u32 mask, void* data);
+
 // -----------------------------------------------------------------------------
 
 struct wroc_zwp_linux_buffer_params : wrei_object
@@ -310,14 +559,53 @@ struct wroc_zwp_linux_buffer_params : wrei_object
 
     wren_dma_params params;
 
+    // Params may only be used to create a single buffer
+    bool used = false;
+
     ~wroc_zwp_linux_buffer_params();
 };
 
 struct wroc_dma_buffer : wroc_wl_buffer
 {
-    virtual void on_commit() final override;
+    // One fd per distinct file behind the planes, used to export the client's write fences on commit
+    std::vector<int> fence_fds;
+
+    ~wroc_dma_buffer();
+
+    virtual void on_commit(wroc_surface*) final override;
 };
 
+// Entry layout of the table shared by zwp_linux_dmabuf_feedback_v1.format_table
+struct wroc_dmabuf_format_table_entry
+{
+    u32 format;
+    u32 padding;
+    u64 modifier;
+};
+
+struct wroc_dmabuf_formats
+{
+    std::vector<wroc_dmabuf_format_table_entry> table;
+
+    // Memory plane count of each entry's modifier
+    std::vector<u32> plane_counts;
+
+    // Sealed copy of the table, shared read-only with every client
+    int table_fd = -1;
+
+    // Table indices of every importable format and modifier, and of the subset preferred for fullscreen surfaces
+    std::vector<u16> tranche_all;
+    std::vector<u16> tranche_scanout;
+
+    ~wroc_dmabuf_formats();
+};
+
+// Builds the format table from every format and modifier that the device can import
+void wroc_dmabuf_init_formats(wroc_server*);
+
+// Resends the surface's feedback if the surface has moved into or out of fullscreen
+void wroc_dmabuf_update_surface_feedback(wroc_surface*);
+
 // -----------------------------------------------------------------------------
 
 struct wroc_seat : wrei_object
@@ -395,10 +683,77 @@ struct wroc_pointer : wrei_object
     wrei_weak<wroc_surface> focused_surface;
 
     wrei_vec2f64 layout_position;
+
+    // Motion tracking, used to predict the pointer position at presentation time
+
+    wrei_vec2f64 velocity; // layout units per second
+    wrei_vec2f64 last_motion_position;
+    u32 last_motion_time;
+    std::chrono::steady_clock::time_point last_motion;
 };
 
+// Motion samples further apart than this do not contribute to the velocity estimate
+static constexpr std::chrono::milliseconds wroc_pointer_velocity_timeout = 50ms;
+
 // -----------------------------------------------------------------------------
 
+struct wroc_render_pipelines
+{
+    VkFormat format;
+    VkPipeline opaque;
+    VkPipeline blend;
+};
+
+// Multi-planar images are always opaque, so only need an opaque pipeline per output format and conversion
+struct wroc_render_ycbcr_pipeline
+{
+    VkFormat format;
+    const wren_ycbcr_conversion* conversion;
+    VkPipeline pipeline;
+};
+
+struct wroc_render_drawable
+{
+    wrei_ref<wroc_wl_buffer> buffer;
+    wrei_ref<wren_image> image;
+    wrei_rect<i32> rect;
+    wrei_region opaque;
+
+    // This job is the first to sample the image, and transitions it out of its initial layout
+    bool init_layout = false;
+};
+
+// Scene state for one output frame, captured on the main thread and handed to the render thread.
+// References are only ever added and released on the main thread, the render thread just reads them
+
+struct wroc_render_job
+{
+    wroc_output* output;
+    wrei_vec2i32 size;
+
+    // Output damage accumulated since the previous job
+    wrei_region damage;
+
+    // Everything that may be drawn, back to front
+    std::vector<wroc_render_drawable> drawables;
+
+    // Wren timeline value of the uploads this frame reads from
+    u64 upload_value;
+
+    // Renderer timeline value signalled once the GPU has finished this frame
+    u64 timeline_value;
+
+    // Measured duration of the frame that previously used the same output frame slot
+    std::optional<std::chrono::nanoseconds> render_time;
+
+    // Request presentation feedback for this frame, its target was recorded when the job was queued
+    bool presentation_feedback;
+
+    // Instance buffer outgrown while recording this frame. Buffers release their memory against the wren
+    // timeline, which only the main thread advances, so it is handed back to be released with the job
+    wrei_ref<wren_buffer> replaced_instances = {};
+};
+
 struct wroc_renderer : wrei_object
 {
     wroc_server* server;
@@ -407,11 +762,66 @@ struct wroc_renderer : wrei_object
 
     wrei_ref<wren_image> image;
 
+    // Compositing pipelines, created on demand for each output format
+    std::vector<wroc_render_pipelines> pipelines;
+    std::vector<wroc_render_ycbcr_pipeline> ycbcr_pipelines;
+
+    // Buffers unlocked while still in use by the GPU
+    std::vector<wrei_ref<wroc_wl_buffer>> pending_release;
+
+    // Signalled by render thread submissions, with values assigned on the main thread when jobs are queued
+    VkSemaphore timeline;
+    u64 timeline_value;
+
+    // Images are updated in place, so the next upload submission must wait for the last
+    // queued frame that sampled any image written since the previous submission
+    u64 upload_wait_value;
+
+    // Acquire, record and present run on a dedicated thread, so that slow frames never block the event loop
+
+    std::jthread thread;
+    std::mutex mutex;
+    std::condition_variable_any cv;
+    // Deques never relocate their elements, which would copy job references on the render thread
+    std::deque<wroc_render_job> queue;
+    std::deque<wroc_render_job> completed;
+    bool rendering;
+
+    // Highest renderer timeline value submitted by the render thread
+    u64 submitted_value;
+
+    // Waits for the GPU to reach each submitted value, so that buffers held by in flight
+    // frames are released as soon as they complete, even if nothing else wakes the event loop
+    std::jthread completion_thread;
+
+    // Signalled by the render thread whenever a job is completed, and by the completion thread
+    // whenever the GPU finishes a frame
+    int completion_fd;
+    wl_event_source* completion_source;
+
+    // Completed jobs, holding on to their scene references until the GPU has finished with them
+    std::vector<wroc_render_job> retired;
+
+    // Workers for copying large shm uploads out of client memory
+
+    wrei_ref<wrei_task_pool> copy_pool;
+    std::vector<std::unique_ptr<wroc_shm_copy>> copies;
+
+    std::mutex copy_mutex;
+    std::vector<wroc_shm_copy*> completed_copies;
+
+    // Signalled by the worker that completes a copy
+    int copy_completion_fd;
+    wl_event_source* copy_completion_source;
+
     ~wroc_renderer();
 };
 
 void wroc_renderer_create(wroc_server*);
+u64  wroc_renderer_get_completed_value(wroc_renderer*);
+void wroc_renderer_flush(wroc_renderer*);
 void wroc_render_frame(wroc_output* output);
+void wroc_update_toplevel_under_cursor(wroc_server*);
 
 enum class wroc_interaction_mode : u32
 {
@@ -439,9 +849,27 @@ struct wroc_server : wrei_object
 
     std::chrono::steady_clock::time_point epoch;
 
+    // Extra time reserved between the end of rendering and the predicted presentation
+    std::chrono::nanoseconds render_safety_margin = 2ms;
+
+    // Maximum distance into the future to extrapolate the pointer when latching interactions, zero to disable
+    std::chrono::nanoseconds pointer_prediction = 0ns;
+
+    wroc_shm_upload_path shm_upload_path = wroc_shm_upload_path::staging;
+
+    // Filled once at startup, buffers point into it
+    std::vector<wroc_shm_format> shm_formats;
+
+    wroc_dmabuf_formats dmabuf_formats;
+
+    // Per frame limits on shm upload work. Once either is exceeded, remaining uploads are deferred to later frames
+    usz upload_budget_bytes = 64 * 1024 * 1024;
+    std::chrono::nanoseconds upload_budget_time = 4ms;
+
     wl_display* display;
     wl_event_loop* event_loop;
 
+    std::vector<wroc_output*> outputs;
     std::vector<wroc_surface*> surfaces;
     wrei_weak<wroc_xdg_toplevel> toplevel_under_cursor;
 
@@ -0,0 +1,26 @@
+#version 460
+#extension GL_GOOGLE_include_directive : require
+
+#include "compositor.glsl"
+
+layout(set = 0, binding = 0) uniform texture2D images[];
+layout(set = 0, binding = 1) uniform sampler   image_sampler;
+
+layout(location = 0) in vec2 in_uv;
+layout(location = 1) flat in uint in_image;
+layout(location = 2) flat in uint in_flags;
+
+layout(location = 0) out vec4 out_color;
+
+void main()
+{
+    vec4 color = texture(sampler2D(images[nonuniformEXT(in_image)], image_sampler), in_uv);
+
+    // Formats without alpha (XRGB) may contain garbage in the unused channel
+
+    if ((in_flags & wroc_instance_opaque) != 0) {
+        color.a = 1.0;
+    }
+
+    out_color = color;
+}
@@ -0,0 +1,24 @@
+#extension GL_EXT_buffer_reference : require
+#extension GL_EXT_scalar_block_layout : require
+#extension GL_EXT_nonuniform_qualifier : require
+
+const uint wroc_instance_opaque = 1 << 0;
+
+struct wroc_instance
+{
+    vec4 dst;
+    vec4 src;
+    uint image;
+    uint flags;
+};
+
+layout(buffer_reference, scalar) readonly buffer wroc_instances
+{
+    wroc_instance data[];
+};
+
+layout(push_constant, scalar) uniform wroc_push_constants
+{
+    wroc_instances instances;
+    vec2 output_size;
+} pc;
@@ -0,0 +1,23 @@
+#version 460
+#extension GL_GOOGLE_include_directive : require
+
+#include "compositor.glsl"
+
+layout(location = 0) out vec2 out_uv;
+layout(location = 1) flat out uint out_image;
+layout(location = 2) flat out uint out_flags;
+
+void main()
+{
+    wroc_instance instance = pc.instances.data[gl_InstanceIndex];
+
+    vec2 corner = vec2(gl_VertexIndex & 1, (gl_VertexIndex >> 1) & 1);
+
+    vec2 pos = instance.dst.xy + corner * instance.dst.zw;
+    out_uv   = instance.src.xy + corner * instance.src.zw;
+
+    out_image = instance.image;
+    out_flags = instance.flags;
+
+    gl_Position = vec4((pos / pc.output_size) * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,19 @@
+#version 460
+#extension GL_GOOGLE_include_directive : require
+
+#include "compositor.glsl"
+
+// Multi-planar images are converted to RGB by the immutable sampler of their set
+
+layout(set = 1, binding = 0) uniform sampler2D ycbcr_image;
+
+layout(location = 0) in vec2 in_uv;
+layout(location = 1) flat in uint in_image;
+layout(location = 2) flat in uint in_flags;
+
+layout(location = 0) out vec4 out_color;
+
+void main()
+{
+    out_color = vec4(texture(ycbcr_image, in_uv).rgb, 1.0);
+}
@@ -1,5 +1,47 @@
 #include "server.hpp"
 
+#include "wren/wren.hpp"
+
+// The GPU reads imported pools directly, so a client truncating the file would fault the device for
+// everyone. Only pools that can't shrink are imported, the rest are uploaded through staging
+
+static
+bool wroc_wl_shm_pool_map(wroc_wl_shm_pool* pool)
+{
+    void* data = mmap(nullptr, pool->size, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+    if (data == MAP_FAILED) return false;
+
+    auto mapping = wrei_adopt_ref(new wroc_shm_mapping {});
+    mapping->data = data;
+    mapping->size = usz(pool->size);
+
+    if (pool->server->shm_upload_path == wroc_shm_upload_path::host_import) {
+        int seals = fcntl(pool->fd, F_GET_SEALS);
+        if (seals >= 0 && (seals & F_SEAL_SHRINK)) {
+            mapping->host_buffer = wren_host_buffer_import(pool->server->renderer->wren.get(), data, mapping->size);
+        }
+    }
+
+    pool->mapping = std::move(mapping);
+    return true;
+}
+
+wroc_shm_mapping::~wroc_shm_mapping()
+{
+    if (host_buffer) {
+        // Copies recorded from the imported mapping may still be pending, so it
+        // must outlive the imported memory, which is freed by deferred destruction
+
+        auto* wren = host_buffer->ctx;
+        host_buffer = nullptr;
+        wren_defer_destroy(wren, [mapped = data, mapped_size = size] {
+            munmap(mapped, mapped_size);
+        });
+    } else {
+        munmap(data, size);
+    }
+}
+
 static
 void wroc_wl_whm_create_pool(wl_client* client, wl_resource* resource, u32 id, int fd, i32 size)
 {
@@ -13,9 +55,9 @@ void wroc_wl_whm_create_pool(wl_client* client, wl_resource* resource, u32 id, i
     pool->fd = fd;
     pool->size = size;
     wroc_resource_set_implementation_refcounted(new_resource, &wroc_wl_shm_pool_impl, pool);
-    pool->data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
-    if (pool->data == MAP_FAILED) {
+    if (!wroc_wl_shm_pool_map(pool)) {
         wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_FD, "mmap failed");
+        return;
     }
 }
 
@@ -33,9 +75,9 @@ void wroc_wl_shm_bind_global(wl_client* client, void* data, u32 version, u32 id)
     shm->wl_shm = new_resource;
     wroc_resource_set_implementation_refcounted(new_resource, &wroc_wl_shm_impl, shm);
 
-    // TODO: Integrate with Wren to expose supported formats
-
-    wl_shm_send_format(new_resource, WL_SHM_FORMAT_XRGB8888);
+    for (auto& format : shm->server->shm_formats) {
+        wl_shm_send_format(new_resource, format.shm);
+    }
 };
 
 // -----------------------------------------------------------------------------
@@ -45,6 +87,20 @@ void wroc_wl_shm_pool_create_buffer(wl_client* client, wl_resource* resource, u3
 {
     auto* pool = wroc_get_userdata<wroc_wl_shm_pool>(resource);
 
+    auto shm_format = std::ranges::find(pool->server->shm_formats, wl_shm_format(format), &wroc_shm_format::shm);
+    if (shm_format == pool->server->shm_formats.end()) {
+        wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_FORMAT, "unsupported format");
+        return;
+    }
+
+    // Rows uploaded as is are addressed in whole texels, converted rows are read byte by byte
+
+    i32 texel_size = i32(shm_format->format.texel_size);
+    if (stride < width * texel_size || stride % (shm_format->converter ? 1 : texel_size)) {
+        wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_STRIDE, "invalid stride for format");
+        return;
+    }
+
     i32 needed = stride * height + offset;
     if (needed > pool->size) {
         wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_STRIDE, "buffer mapped storage exceeds pool limits");
@@ -59,11 +115,13 @@ void wroc_wl_shm_pool_create_buffer(wl_client* client, wl_resource* resource, u3
     shm_buffer->wl_buffer = new_resource;
     shm_buffer->pool = pool;
     shm_buffer->extent = {width, height};
+    shm_buffer->offset = offset;
     shm_buffer->stride = stride;
-    shm_buffer->format = wl_shm_format(format);
+    shm_buffer->format = &*shm_format;
+    shm_buffer->opaque = shm_format->format.opaque;
     wroc_resource_set_implementation_refcounted(new_resource, &wroc_wl_buffer_impl, shm_buffer);
 
-    shm_buffer->image = wren_image_create(shm_buffer->server->renderer->wren.get(), {u32(width), u32(height)}, VK_FORMAT_B8G8R8A8_UNORM);
+    // The image is only acquired on first upload, as many buffers are destroyed without ever being committed
 
     log_warn("buffer created ({}, {})", width, height);
 }
@@ -72,11 +130,14 @@ static
 void wroc_wl_shm_pool_resize(wl_client* client, wl_resource* resource, i32 size)
 {
     auto* pool = wroc_get_userdata<wroc_wl_shm_pool>(resource);
-    munmap(pool->data, pool->size);
-    pool->data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+
+    // The old mapping is released once any copies still reading from it complete
+
+    pool->mapping = nullptr;
     pool->size = size;
-    if (!pool->data) {
+    if (!wroc_wl_shm_pool_map(pool)) {
         wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_FD, "mmap failed while resizing pool");
+        return;
     }
 }
 
@@ -88,14 +149,466 @@ const struct wl_shm_pool_interface wroc_wl_shm_pool_impl = {
 
 wroc_wl_shm_pool::~wroc_wl_shm_pool()
 {
-    if (data) munmap(data, size);
+    mapping = nullptr;
     close(fd);
 }
 
-void wroc_shm_buffer::on_commit()
+// Returns the layout area covered by rects if any of it is visible on an output, otherwise an empty region
+static
+wrei_region wroc_shm_buffer_get_visible_damage(wroc_surface* surface, std::span<const VkRect2D> rects)
+{
+    auto* xdg_surface = wroc_xdg_surface::try_from(surface);
+    if (!xdg_surface) return {};
+
+    auto layout_rect = wroc_xdg_surface_get_layout_rect(xdg_surface);
+    auto scale = surface->current.buffer_scale;
+
+    wrei_region damage;
+    for (auto& rect : rects) {
+        wrei_vec2i32 start = glm::floor(wrei_vec2f64(rect.offset.x, rect.offset.y) / scale);
+        wrei_vec2i32 end   = glm::ceil( wrei_vec2f64(rect.offset.x + rect.extent.width, rect.offset.y + rect.extent.height) / scale);
+        damage.add({start, end - start});
+    }
+    damage.translate(layout_rect.origin);
+    damage.intersect(layout_rect);
+
+    for (auto* output : surface->server->outputs) {
+        wrei_region local = damage;
+        local.intersect({wrei_vec2i32(output->position), output->size});
+        if (!local.empty()) return damage;
+    }
+
+    return {};
+}
+
+void wroc_shm_buffer::on_commit(wroc_surface* surface)
 {
+    // Hold the buffer until the next frame is built. If it is superseded before then it is released
+    // without ever being read, and its stale region still covers everything that it would have uploaded
+
     lock();
-    wren_image_update(image.get(), static_cast<char*>(pool->data) + offset);
-    // log_debug("buffer updated ({}, {})", extent.x, extent.y);
+    surface->upload_pending = true;
+    wroc_request_frame(server);
+}
+
+int wroc_shm_handle_copy_completion(int fd, u32, void* data)
+{
+    auto* renderer = static_cast<wroc_renderer*>(data);
+    auto* server = renderer->server;
+
+    eventfd_t count;
+    eventfd_read(fd, &count);
+
+    std::vector<wroc_shm_copy*> completed;
+    {
+        std::scoped_lock lock{renderer->copy_mutex};
+        std::swap(completed, renderer->completed_copies);
+    }
+
+    for (auto* copy : completed) {
+        auto* buffer = copy->buffer.get();
+
+        // Record the copy for the next render job, which must wait for frames still sampling the image
+
+        buffer->recorded_upload_use = renderer->timeline_value + 1;
+        renderer->upload_wait_value = std::max(renderer->upload_wait_value, buffer->last_use);
+
+        wren_image_copy_rects(buffer->image.get(), copy->staging->buffer, 0, copy->staging_stride, copy->rects, copy->first_row);
+        wren_keep_alive(renderer->wren.get(), copy->staging);
+
+        buffer->reading = false;
+
+        // The client may have committed the buffer again while it was being copied, in which
+        // case it stays locked for the upload that follows
+
+        auto* surface = copy->surface.get();
+        bool current = surface && surface->current.buffer.get() == buffer;
+        if (!(current && surface->upload_pending)) {
+            buffer->unlock();
+            if (current) wroc_surface_finish_upload(surface);
+        }
+
+        std::erase_if(renderer->copies, [&](const auto& c) { return c.get() == copy; });
+    }
+
+    wroc_wl_buffer_release_completed(server);
+    wroc_request_frame(server);
+
+    return 0;
+}
+
+usz wroc_shm_buffer::get_upload_size()
+{
+    usz texel_size = format->image_texel_size;
+
+    if (!image) return usz(extent.x) * extent.y * texel_size;
+
+    wrei_region region = stale;
+    region.intersect({{}, extent});
+
+    usz size = 0;
+    for (auto& box : region.boxes()) {
+        size += usz(box.x2 - box.x1) * (box.y2 - box.y1) * texel_size;
+    }
+    return size;
+}
+
+// Copies the rows covering rects into a staging buffer, split into bands across the renderer's workers,
+// converting them to the image format if required. The buffer stays locked until wroc_shm_handle_copy_completion records the copy into its image
+static
+void wroc_shm_buffer_copy_async(wroc_shm_buffer* buffer, wroc_surface* surface, std::vector<VkRect2D> rects)
+{
+    auto* renderer = buffer->server->renderer.get();
+
+    u32 first_row = UINT32_MAX;
+    u32 last_row = 0;
+    for (auto& rect : rects) {
+        first_row = std::min(first_row, u32(rect.offset.y));
+        last_row = std::max(last_row, u32(rect.offset.y) + rect.extent.height);
+    }
+
+    auto* converter = buffer->format->converter;
+
+    usz stride = buffer->stride;
+    usz staging_stride = converter ? usz(buffer->extent.x) * buffer->format->image_texel_size : stride;
+    usz rows = last_row - first_row;
+
+    auto* copy = renderer->copies.emplace_back(new wroc_shm_copy {
+        .buffer = buffer,
+        .surface = wrei_weak_from(surface),
+        .mapping = buffer->pool->mapping,
+        .staging = wren_buffer_create(renderer->wren.get(), rows * staging_stride),
+        .staging_stride = staging_stride,
+        .rects = std::move(rects),
+        .first_row = first_row,
+    }).get();
+
+    u32 bands = u32(std::clamp<usz>(rows * staging_stride / wroc_shm_copy_band_size, 1, renderer->copy_pool->workers.size()));
+    usz rows_per_band = (rows + bands - 1) / bands;
+    bands = u32((rows + rows_per_band - 1) / rows_per_band);
+    copy->remaining = bands;
+
+    buffer->reading = true;
+
+    // Tasks only see plain pointers, as reference counts are not thread safe
+
+    auto* src = static_cast<const char*>(copy->mapping->data) + buffer->offset + first_row * stride;
+    auto* dst = copy->staging->host<char>();
+
+    auto convert = converter ? converter->convert : nullptr;
+    usz width = buffer->extent.x;
+
+    for (u32 band = 0; band < bands; ++band) {
+        usz begin = band * rows_per_band;
+        usz end = std::min(rows, (band + 1) * rows_per_band);
+
+        wrei_task_pool_submit(renderer->copy_pool.get(), [=] {
+            if (convert) {
+                for (usz row = begin; row < end; ++row) {
+                    convert(dst + row * staging_stride, src + row * stride, width);
+                }
+            } else {
+                std::memcpy(dst + begin * stride, src + begin * stride, (end - begin) * stride);
+            }
+
+            if (copy->remaining.fetch_sub(1) == 1) {
+                {
+                    std::scoped_lock lock{renderer->copy_mutex};
+                    renderer->completed_copies.emplace_back(copy);
+                }
+                eventfd_write(renderer->copy_completion_fd, 1);
+            }
+        });
+    }
+}
+
+bool wroc_shm_buffer::upload(wroc_surface* surface)
+{
+    auto* renderer = server->renderer.get();
+    auto* wren = renderer->wren.get();
+
+    if (!image) {
+        bool host_copy = server->shm_upload_path == wroc_shm_upload_path::host_copy
+            && !format->converter
+            && wren_image_host_copy_supported(wren, format->image_format);
+        VkImageUsageFlags extra_usage = host_copy ? VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT : 0;
+        image = wren_image_create(wren, {u32(extent.x), u32(extent.y)}, format->image_format, extra_usage);
+        stale = wrei_region({{}, extent});
+    }
+
+    // Only upload what changed since the image was last updated
+
+    stale.intersect({{}, extent});
+
+    // Copies on the transfer queue need buffer offsets aligned to 4 bytes, so 2 byte texels start on even columns
+
+    u32 texel_size = format->image_texel_size;
+
+    std::vector<VkRect2D> rects;
+    for (auto& box : stale.boxes()) {
+        i32 x = texel_size == 2 ? box.x1 & ~1 : box.x1;
+        rects.emplace_back(VkRect2D {
+            .offset = { x, box.y1 },
+            .extent = { u32(box.x2 - x), u32(box.y2 - box.y1) },
+        });
+    }
+    stale.clear();
+
+    auto* mapping = pool->mapping.get();
+    if (!mapping) {
+        unlock();
+        return true;
+    }
+
+    auto* data = static_cast<char*>(mapping->data) + offset;
+
+    // Host copies are not ordered against device work, so they can only be used once every frame that
+    // sampled the image and every recorded copy into it has completed. Otherwise fall back to recording
+
+    bool aligned = offset % 4 == 0 && stride % 4 == 0;
+
+    if (image->usage & VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT && aligned) {
+        if (std::max(last_use, recorded_upload_use) <= wroc_renderer_get_completed_value(renderer)) {
+            wren_image_host_copy_rects(image.get(), data, stride, rects);
+            unlock();
+            return true;
+        }
+    }
+
+    // Recorded copies are submitted no later than the next queued render job, and must wait for frames still
+    // sampling the image
+
+    recorded_upload_use = renderer->timeline_value + 1;
+    renderer->upload_wait_value = std::max(renderer->upload_wait_value, last_use);
+
+    // Copy straight out of the imported pool when the damage is visible on an output. The render job queued
+    // for that output flushes the copy, and the buffer is held until that job completes. Otherwise there is
+    // no guarantee of a submission any time soon, so stage the pixels and release the buffer immediately
+
+    if (mapping->host_buffer && !format->converter && aligned) {
+        auto damage = wroc_shm_buffer_get_visible_damage(surface, rects);
+        if (!damage.empty()) {
+            wren_image_copy_rects(image.get(), mapping->host_buffer->buffer, offset, stride, rects);
+            last_use = recorded_upload_use;
+            wroc_damage_layout(server, damage);
+            unlock();
+            return true;
+        }
+    }
+
+    // Large uploads are copied out of the pool on worker threads, and recorded once they complete
+
+    usz size = 0;
+    for (auto& rect : rects) size += usz(rect.extent.width) * rect.extent.height * texel_size;
+
+    if (size >= wroc_shm_parallel_copy_threshold && !renderer->copy_pool->workers.empty()
+            && (format->converter || stride % 4 == 0)) {
+        wroc_shm_buffer_copy_async(this, surface, std::move(rects));
+        return false;
+    }
+
+    wren_image_update_rects(image.get(), data, stride, rects, format->converter);
+    // log_debug("buffer updated ({}, {}), {} rects", extent.x, extent.y, rects.size());
+
     unlock();
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+
+// Times full-screen uploads through each supported path, including the submission and wait required for
+// recorded copies. Host copies write the image directly, and so have no round trip through the queue
+static
+void wroc_shm_benchmark_upload_paths(wroc_server* server)
+{
+    auto* wren = server->renderer->wren.get();
+
+    constexpr VkExtent2D extent = { 1920, 1080 };
+    constexpr u32 iterations = 100;
+    constexpr usz stride = extent.width * 4;
+    constexpr usz size = stride * extent.height;
+
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        log_error("Failed to allocate upload benchmark memory");
+        return;
+    }
+
+    // Imported memory is freed by deferred destruction, which the unmap must follow
+    bool imported = false;
+    defer {
+        if (imported) wren_defer_destroy(wren, [data] { munmap(data, size); });
+        else          munmap(data, size);
+    };
+
+    std::memset(data, 0x80, size);
+
+    std::array rects { VkRect2D { {}, extent } };
+
+    auto submit_and_wait = [&] {
+        wren_wait_for_timeline_value(wren, {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = wren->timeline,
+            .value = wren_submit(wren),
+        });
+    };
+
+    auto measure = [&](const char* name, VkImageUsageFlags extra_usage, auto&& upload) {
+        auto image = wren_image_create(wren, extent, VK_FORMAT_B8G8R8A8_UNORM, extra_usage);
+
+        // Warm up, which also performs any first time allocation of staging memory
+        upload(image.get());
+
+        auto start = std::chrono::steady_clock::now();
+        for (u32 i = 0; i < iterations; ++i) {
+            upload(image.get());
+        }
+        auto elapsed = (std::chrono::steady_clock::now() - start) / iterations;
+
+        log_info("  {:<11} {} per {}x{} upload", name, wrei_duration_to_string(elapsed), extent.width, extent.height);
+    };
+
+    log_info("Benchmarking shm upload paths ({} iterations)", iterations);
+
+    measure("staging", 0, [&](wren_image* image) {
+        wren_image_update_rects(image, data, stride, rects);
+        submit_and_wait();
+    });
+
+    if (auto host_buffer = wren_host_buffer_import(wren, data, size)) {
+        imported = true;
+        measure("host_import", 0, [&](wren_image* image) {
+            wren_image_copy_rects(image, host_buffer->buffer, 0, stride, rects);
+            submit_and_wait();
+        });
+    }
+
+    if (wren_image_host_copy_supported(wren, VK_FORMAT_B8G8R8A8_UNORM)) {
+        measure("host_copy", VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT, [&](wren_image* image) {
+            wren_image_host_copy_rects(image, data, stride, rects);
+        });
+    }
+}
+
+void wroc_shm_select_upload_path(wroc_server* server)
+{
+    auto* wren = server->renderer->wren.get();
+
+    if (getenv("WROC_SHM_UPLOAD_BENCHMARK")) {
+        wroc_shm_benchmark_upload_paths(server);
+    }
+
+    bool host_import = wren->host_memory_import;
+    bool host_copy = wren_image_host_copy_supported(wren, VK_FORMAT_B8G8R8A8_UNORM);
+
+    // By default host copies are only preferred on CPU devices, where the image lives in host memory anyway
+
+    auto path = wroc_shm_upload_path::staging;
+    if (host_copy && wren->device_type == VK_PHYSICAL_DEVICE_TYPE_CPU) {
+        path = wroc_shm_upload_path::host_copy;
+    } else if (host_import) {
+        path = wroc_shm_upload_path::host_import;
+    }
+
+    if (const char* requested = getenv("WROC_SHM_UPLOAD_PATH")) {
+        std::string_view name = requested;
+        if (name == "staging") {
+            path = wroc_shm_upload_path::staging;
+        } else if (name == "host_import" && host_import) {
+            path = wroc_shm_upload_path::host_import;
+        } else if (name == "host_copy" && host_copy) {
+            path = wroc_shm_upload_path::host_copy;
+        } else if (name != "auto") {
+            log_warn("Unknown or unsupported shm upload path: {}", name);
+        }
+    }
+
+    server->shm_upload_path = path;
+
+    switch (path) {
+        break;case wroc_shm_upload_path::staging:     log_info("Shm upload path: staging");
+        break;case wroc_shm_upload_path::host_import: log_info("Shm upload path: host_import");
+        break;case wroc_shm_upload_path::host_copy:   log_info("Shm upload path: host_copy");
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+static
+std::string wroc_fourcc_to_string(u32 fourcc)
+{
+    return std::string(reinterpret_cast<const char*>(&fourcc), sizeof(fourcc));
+}
+
+static
+void wroc_shm_benchmark_conversion()
+{
+    constexpr u32 width = 1920;
+    constexpr u32 height = 1080;
+    constexpr u32 iterations = 20;
+
+    std::vector<u8> src(usz(width) * height * 4);
+    std::vector<u8> dst(usz(width) * height * 4);
+    for (usz i = 0; i < src.size(); ++i) src[i] = u8(i * 7);
+
+    log_info("Benchmarking pixel conversion ({} iterations)", iterations);
+
+    for (u32 drm_format : { DRM_FORMAT_RGB888, DRM_FORMAT_BGR888, DRM_FORMAT_RGB565, DRM_FORMAT_BGR565 }) {
+        auto* converter = wrei_find_pixel_converter(drm_format);
+        if (!converter) continue;
+
+        for (auto level : magic_enum::enum_values<wrei_simd_level>()) {
+            auto convert = wrei_get_pixel_convert_fn(drm_format, level);
+            if (!convert) continue;
+
+            auto run = [&] {
+                for (u32 y = 0; y < height; ++y) {
+                    convert(dst.data() + usz(y) * width * 4, src.data() + usz(y) * width * converter->src_size, width);
+                }
+            };
+
+            // Warm up, which also faults in the destination pages
+            run();
+
+            auto start = std::chrono::steady_clock::now();
+            for (u32 i = 0; i < iterations; ++i) {
+                run();
+            }
+            auto elapsed = std::chrono::duration<f64, std::nano>(std::chrono::steady_clock::now() - start) / iterations;
+
+            log_info("  {:<8} {:<6} {} per {}x{} frame ({:.0f} MPix/s)",
+                wroc_fourcc_to_string(drm_format), magic_enum::enum_name(level), wrei_duration_to_string(elapsed),
+                width, height, f64(width) * height / elapsed.count() * 1e3);
+        }
+    }
+}
+
+void wroc_shm_init_formats(wroc_server* server)
+{
+    auto* wren = server->renderer->wren.get();
+
+    if (getenv("WROC_SHM_CONVERT_BENCHMARK")) {
+        wroc_shm_benchmark_conversion();
+    }
+
+    for (auto& format : wren_get_formats()) {
+        if (format.is_ycbcr) continue;
+
+        // wl_shm reuses DRM fourcc codes, except for the two formats every compositor must support
+        auto shm = format.drm == DRM_FORMAT_ARGB8888 ? WL_SHM_FORMAT_ARGB8888
+                 : format.drm == DRM_FORMAT_XRGB8888 ? WL_SHM_FORMAT_XRGB8888
+                 : wl_shm_format(format.drm);
+
+        // 3 byte texels can never satisfy the 4 byte buffer offset alignment of the transfer queue,
+        // so those formats are always converted, even if the device could sample them
+
+        if (format.texel_size != 3 && wren_format_is_sampleable(wren, format.vk)) {
+            server->shm_formats.emplace_back(shm, format, nullptr, format.vk, format.texel_size);
+        } else if (auto* converter = wrei_find_pixel_converter(format.drm)) {
+            server->shm_formats.emplace_back(shm, format, converter, VK_FORMAT_B8G8R8A8_UNORM, 4u);
+            log_info("Shm format {} converted to B8G8R8A8 on upload", wroc_fourcc_to_string(format.drm));
+        }
+    }
+
+    log_info("Shm formats: {}", server->shm_formats.size());
 }
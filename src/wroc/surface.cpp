@@ -108,6 +108,33 @@ void wroc_wl_surface_set_input_region(wl_client* client, wl_resource* resource,
     surface->pending.committed |= wroc_surface_committed_state::input_region;
 }
 
+static
+void wroc_wl_surface_set_opaque_region(wl_client* client, wl_resource* resource, wl_resource* opaque_region)
+{
+    auto* surface = wroc_get_userdata<wroc_surface>(resource);
+    auto* region = wroc_get_userdata<wroc_wl_region>(opaque_region);
+    if (region) {
+        surface->pending.opaque_region = region->region;
+    } else {
+        surface->pending.opaque_region.clear();
+    }
+    surface->pending.committed |= wroc_surface_committed_state::opaque_region;
+}
+
+static
+void wroc_wl_surface_damage(wl_client* client, wl_resource* resource, i32 x, i32 y, i32 width, i32 height)
+{
+    auto* surface = wroc_get_userdata<wroc_surface>(resource);
+    surface->pending.surface_damage.add({{x, y}, {width, height}});
+}
+
+static
+void wroc_wl_surface_damage_buffer(wl_client* client, wl_resource* resource, i32 x, i32 y, i32 width, i32 height)
+{
+    auto* surface = wroc_get_userdata<wroc_surface>(resource);
+    surface->pending.buffer_damage.add({{x, y}, {width, height}});
+}
+
 static
 void wroc_wl_surface_offset(wl_client* client, wl_resource* resource, i32 x, i32 y)
 {
@@ -116,11 +143,56 @@ void wroc_wl_surface_offset(wl_client* client, wl_resource* resource, i32 x, i32
     surface->pending.committed |= wroc_surface_committed_state::offset;
 }
 
+static
+void wroc_surface_track_buffer_damage(wroc_surface* surface)
+{
+    auto* buffer = surface->pending.committed >= wroc_surface_committed_state::buffer
+        ? surface->pending.buffer.get()
+        : nullptr;
+
+    // Convert surface damage to buffer coordinates
+
+    wrei_region damage = surface->pending.buffer_damage;
+    for (auto& box : surface->pending.surface_damage.boxes()) {
+        auto scale = surface->current.buffer_scale;
+        auto start = glm::floor(wrei_vec2f64(box.x1, box.y1) * scale);
+        auto end   = glm::ceil( wrei_vec2f64(box.x2, box.y2) * scale);
+        start = glm::clamp(start, wrei_vec2f64(0), wrei_vec2f64(INT32_MAX));
+        end   = glm::clamp(end,   wrei_vec2f64(0), wrei_vec2f64(INT32_MAX));
+        damage.add({wrei_vec2i32(start), wrei_vec2i32(end - start)});
+    }
+
+    std::erase_if(surface->committed_buffers, [](const wrei_weak<wroc_wl_buffer>& weak) { return !weak; });
+
+    for (auto& weak : surface->committed_buffers) {
+        weak->stale.add(damage);
+    }
+
+    // Only shm buffers are copied, dmabuf images alias client memory directly
+
+    if (!buffer || buffer->type != wroc_wl_buffer_type::shm) return;
+
+    // Buffers new to this surface have unknown contents
+
+    if (std::ranges::find(surface->committed_buffers, buffer, &wrei_weak<wroc_wl_buffer>::get) == surface->committed_buffers.end()) {
+        buffer->stale.add({{}, buffer->extent});
+        surface->committed_buffers.emplace_back(wrei_weak_from(buffer));
+        if (surface->committed_buffers.size() > wroc_surface_max_committed_buffers) {
+            surface->committed_buffers.erase(surface->committed_buffers.begin());
+        }
+    }
+}
+
 static
 void wroc_wl_surface_commit(wl_client* client, wl_resource* resource)
 {
     auto* surface = wroc_get_userdata<wroc_surface>(resource);
 
+    wroc_wl_buffer_release_completed(surface->server);
+
+    auto* xdg_surface = wroc_xdg_surface::try_from(surface);
+    auto old_rect = xdg_surface ? wroc_xdg_surface_get_layout_rect(xdg_surface) : wrei_rect<i32>{};
+
     // Handle initial commit
 
     if (surface->initial_commit) {
@@ -131,9 +203,9 @@ void wroc_wl_surface_commit(wl_client* client, wl_resource* resource)
         }
     }
 
-    // Update frame callbacks
+    // Track which parts of previously committed buffers are out of date, so that uploads can be limited to them
 
-    surface->current.frame_callbacks.take_and_append_all(std::move(surface->pending.frame_callbacks));
+    wroc_surface_track_buffer_damage(surface);
 
     // Update buffer
 
@@ -142,14 +214,22 @@ void wroc_wl_surface_commit(wl_client* client, wl_resource* resource)
             log_error("Client is attempting to commit buffer that is already locked!");
         }
 
-        if (surface->current.buffer) {
-            surface->current.buffer->unlock();
+        // Dmabufs stay locked while they wait on their fences, and once displayed until their successor
+        // replaces them on screen
+
+        if (auto* previous = surface->current.buffer.get()) {
+            if (previous->type != wroc_wl_buffer_type::dma) {
+                previous->unlock();
+            }
         }
+        surface->upload_pending = false;
+
+        usz fenced_count = surface->fenced_buffers.size();
 
         if (surface->pending.buffer) {
             if (surface->pending.buffer->wl_buffer) {
                 surface->current.buffer = surface->pending.buffer;
-                surface->current.buffer->on_commit();
+                surface->current.buffer->on_commit(surface);
             } else {
                 log_warn("Pending buffer was destroyed, surface contents will be cleared");
                 surface->current.buffer = nullptr;
@@ -159,15 +239,46 @@ void wroc_wl_surface_commit(wl_client* client, wl_resource* resource)
             surface->current.buffer = nullptr;
         }
 
+        // Buffers that need uploading are displayed once their upload has been recorded, and
+        // dmabufs once their fences have signalled. Anything else is displayed immediately, and
+        // replaces any dmabufs that are still waiting
+
+        if (surface->fenced_buffers.size() == fenced_count) {
+            wroc_surface_drop_fenced_buffers(surface, fenced_count);
+            if (!surface->upload_pending) {
+                surface->upload_deferred = false;
+                wroc_surface_finish_upload(surface);
+            }
+        }
+
         surface->pending.buffer = nullptr;
     }
 
+    // Update frame callbacks, which wait for the newest fenced buffer so that clients are paced by
+    // the buffers that actually reach the screen
+
+    auto& frame_callbacks = surface->fenced_buffers.empty()
+        ? surface->current.frame_callbacks
+        : surface->fenced_buffers.back()->frame_callbacks;
+    frame_callbacks.take_and_append_all(std::move(surface->pending.frame_callbacks));
+    if (surface->current.frame_callbacks.front()) {
+        wroc_request_frame(surface->server);
+    }
+
     // Update input region
 
     if (surface->pending.committed >= wroc_surface_committed_state::input_region) {
         surface->current.input_region = std::move(surface->pending.input_region);
     }
 
+    // Update opaque region
+
+    bool opaque_changed = false;
+    if (surface->pending.committed >= wroc_surface_committed_state::opaque_region) {
+        surface->current.opaque_region = std::move(surface->pending.opaque_region);
+        opaque_changed = true;
+    }
+
     // Update offset
 
     if (surface->pending.committed >= wroc_surface_committed_state::offset) {
@@ -185,19 +296,50 @@ void wroc_wl_surface_commit(wl_client* client, wl_resource* resource)
     if (surface->role_addon) {
         surface->role_addon->on_commit();
     }
+
+    // Apply damage
+
+    wrei_region damage = std::move(surface->pending.surface_damage);
+    for (auto& box : surface->pending.buffer_damage.boxes()) {
+        auto scale = surface->current.buffer_scale;
+        wrei_vec2i32 start = glm::floor(wrei_vec2f64(box.x1, box.y1) / scale);
+        wrei_vec2i32 end   = glm::ceil( wrei_vec2f64(box.x2, box.y2) / scale);
+        damage.add({start, end - start});
+    }
+    surface->pending.surface_damage.clear();
+    surface->pending.buffer_damage.clear();
+
+    if (xdg_surface) {
+        auto new_rect = wroc_xdg_surface_get_layout_rect(xdg_surface);
+        if (new_rect.origin != old_rect.origin || new_rect.extent != old_rect.extent) {
+            wroc_damage_layout(surface->server, old_rect);
+            wroc_damage_layout(surface->server, new_rect);
+        } else if (opaque_changed) {
+            // Occlusion of everything beneath the surface may have changed
+            wroc_damage_layout(surface->server, new_rect);
+        } else if (!damage.empty()) {
+            damage.translate(new_rect.origin);
+            damage.intersect(new_rect);
+            wroc_damage_layout(surface->server, damage);
+        }
+    }
+
+    // Fullscreen surfaces are offered a different set of preferred formats
+
+    wroc_dmabuf_update_surface_feedback(surface);
 }
 
 const struct wl_surface_interface wroc_wl_surface_impl = {
     .destroy              = wroc_simple_resource_destroy_callback,
     .attach               = wroc_wl_surface_attach,
-    .damage               = WROC_STUB,
+    .damage               = wroc_wl_surface_damage,
     .frame                = wroc_wl_surface_frame,
-    .set_opaque_region    = WROC_STUB,
+    .set_opaque_region    = wroc_wl_surface_set_opaque_region,
     .set_input_region     = wroc_wl_surface_set_input_region,
     .commit               = wroc_wl_surface_commit,
     .set_buffer_transform = WROC_STUB,
     .set_buffer_scale     = WROC_STUB,
-    .damage_buffer        = WROC_STUB,
+    .damage_buffer        = wroc_wl_surface_damage_buffer,
     .offset               = wroc_wl_surface_offset,
 };
 
@@ -205,6 +347,18 @@ wroc_surface::~wroc_surface()
 {
     std::erase(server->surfaces, this);
 
+    for (auto& fenced : fenced_buffers) {
+        fenced->buffer->unlock();
+    }
+    fenced_buffers.clear();
+
+    if (current.buffer) {
+        current.buffer->unlock();
+    }
+    if (displayed_buffer && displayed_buffer.get() != current.buffer.get() && displayed_buffer->type == wroc_wl_buffer_type::dma) {
+        displayed_buffer->unlock();
+    }
+
     log_warn("wroc_surface DESTROY, this = {}", (void*)this);
 }
 
@@ -85,6 +85,8 @@ void wroc_xdg_surface::on_commit()
 
 wroc_xdg_surface::~wroc_xdg_surface()
 {
+    wroc_damage_layout(surface->server, wroc_xdg_surface_get_layout_rect(this));
+
     if (surface->role_addon == this) {
         surface->role_addon = nullptr;
     }
@@ -131,6 +133,16 @@ wrei_rect<i32> wroc_xdg_surface_get_geometry(wroc_xdg_surface* xdg_surface)
     return geom;
 }
 
+wrei_rect<i32> wroc_xdg_surface_get_layout_rect(wroc_xdg_surface* xdg_surface)
+{
+    wrei_rect<i32> rect = {};
+    if (auto* buffer = xdg_surface->surface->current.buffer.get()) {
+        rect.origin = wrei_vec2i32(glm::floor(xdg_surface->position)) - wroc_xdg_surface_get_geometry(xdg_surface).origin;
+        rect.extent = buffer->extent;
+    }
+    return rect;
+}
+
 // -----------------------------------------------------------------------------
 
 static